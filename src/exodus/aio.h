@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <exodus/types.h>
+
+/* HolyC's CAioReq, res is bytes moved or -errno once done is set,
+ * fin is set once neither *r nor *wake will be touched again */
+typedef struct {
+  i64 res, done, fin;
+} CAioReq;
+
+/* wake_jiffy of a task parked in AioRW(), INT64_MAX is AddrWait()'s */
+#define AIO_PARKED (INT64_MAX - 1)
+
+/* pread/pwrite(fd, buf, len, off) off the calling core's thread.
+ * On completion fills in *r, zeroes *wake if it is still AIO_PARKED,
+ * sets r->fin and wakes the core that submitted it */
+void AioSubmit(CAioReq *r, int fd, u8 *buf, u64 len, i64 off, bool wr,
+               i64 *wake);
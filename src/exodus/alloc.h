@@ -3,4 +3,26 @@
 #include <exodus/types.h>
 
 void *NewVirtualChunk(u64 sz, bool exec);
+/* NULL if [at, at+sz) is taken */
+void *NewVirtualChunkAt(void *at, u64 sz, bool exec);
+/* sz as passed to NewVirtualChunk() */
 void FreeVirtualChunk(void *ptr, u64 sz);
+/* chunks from NewVirtualChunkAt() or ClaimVirtualChunk(), which are only
+ * ever page rounded */
+void FreeVirtualChunkAt(void *ptr, u64 sz);
+/* what NewVirtualChunk(sz) really maps, more than sz with huge pages on */
+u64 VirtualChunkSz(u64 sz);
+/* back big chunks with 2MiB pages, call before the first chunk */
+void HugePagesEnable(void);
+/* live chunk bytes, of which in 2MiB aligned chunks,
+ * chunks from MAP_HUGETLB, chunks madvise'd for THP */
+void HugePagesStats(u64 *out);
+
+/* posix: carve [at, at+sz) out of the reserved low window (q.v. alloc.c),
+ * map over it with MAP_FIXED when it returns VCHUNK_CLAIMED */
+enum {
+  VCHUNK_OUTSIDE,
+  VCHUNK_CLAIMED,
+  VCHUNK_TAKEN,
+};
+int ClaimVirtualChunk(void *at, u64 sz);
@@ -0,0 +1,321 @@
+// vi: set et ft=c ts=2 sts=2 sw=2 fenc=utf-8 :vi
+//
+// Copyright 2024 1fishe2fishe
+// Refer to the LICENSE file for license info.
+// Any citation links are provided at the end of the file.
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <exodus/arc.h>
+#include <exodus/misc.h>
+#include <exodus/types.h>
+
+/* .Z files
+ *
+ * COMPRESS.HC's LZW[1] is a straight port of the original TempleOS one, so
+ * this has to stay in lockstep with it rather than with any other LZW:
+ *   - codes are LSB first (BFieldOrU32/BFieldExtU32), starting at bit
+ *     ARC_HDR_SZ*8 of the CArcCompress
+ *   - code width starts at min_bits+1 (min_bits is 7 if no byte has the
+ *     top bit set, CT_7_BIT) and grows to ARC_BITS_MAX, there's no clear
+ *     code
+ *   - once the table is full entries get recycled round robin, skipping
+ *     any that still have children (ArcEntryGet)
+ *   - the last code's width is next_bits_in_use (ArcFinishCompression)
+ * The structure mirrors the HolyC down to where ArcEntryGet() gets called,
+ * with indices in place of CArcEntry pointers. Expanding is resumable at
+ * any output boundary like ArcExpandBuf(), which is what ArcXRead() is */
+
+#define ARC_BITS_MAX 12
+#define ARC_ENTS     (1 << ARC_BITS_MAX)
+
+enum {
+  CT_NONE = 1,
+  CT_7_BIT,
+  CT_8_BIT,
+};
+
+/* CArcEntry, 0 is NULL since entries below min_tab are never handed out.
+ * Siblings never share a ch so their order doesn't matter and prev can take
+ * the place of ArcEntryGet()'s walk, 0 is the head (hash[basecode]) */
+typedef struct {
+  u16 basecode, next, prev;
+  u8 ch;
+  bool linked;
+} CArcEnt;
+
+/* the table half of CArcCtrl */
+typedef struct {
+  i64 min_tab, cur, next, cur_bits, next_bits, free_idx, free_limit;
+  bool used;
+  CArcEnt ent[ARC_ENTS];
+  u16 hash[ARC_ENTS]; /* first child */
+  u64 kids[ARC_ENTS / 64]; /* hash[i] != 0 */
+} CArcTab;
+
+struct CArcX {
+  CArcTab t;
+  u8 const *src;
+  u64 src_pos, src_size, left;
+  i64 saved, last_ch, sp;
+  u8 stk[ARC_ENTS];
+  u16 len[ARC_ENTS]; /* of the string each entry stands for */
+};
+
+static void entryget(CArcTab *t) {
+  if (!t->used)
+    return;
+  i64 i = t->free_idx;
+  t->used = false;
+  t->cur = t->next;
+  t->cur_bits = t->next_bits;
+  if (t->next_bits < ARC_BITS_MAX) {
+    t->next = i++;
+    if (i == t->free_limit)
+      t->free_limit = 1 << ++t->next_bits;
+  } else {
+    /* do if (++i==free_limit) i=min_table_entry; while (hash[i]);
+     * a word of kids at a time, this is most of the time spent once the
+     * table fills up (free_limit is ARC_ENTS by now) */
+    for (;;) {
+      if (++i == ARC_ENTS)
+        i = t->min_tab;
+      u64 w = ~t->kids[i / 64] >> i % 64;
+      if (w) {
+        i += __builtin_ctzll(w);
+        break;
+      }
+      i |= 63;
+    }
+    t->next = i;
+    CArcEnt *e = t->ent + i;
+    if (e->linked) {
+      e->linked = false;
+      if (e->prev)
+        t->ent[e->prev].next = e->next;
+      else if (!(t->hash[e->basecode] = e->next))
+        t->kids[e->basecode / 64] &= ~(1ul << e->basecode % 64);
+      if (e->next)
+        t->ent[e->next].prev = e->prev;
+    }
+  }
+  t->free_idx = i;
+}
+
+/* ArcCtrlNew() */
+static void tabinit(CArcTab *t, u8 ct) {
+  i64 min_bits = ct == CT_7_BIT ? 7 : 8;
+  t->min_tab = 1 << min_bits;
+  t->free_idx = t->min_tab;
+  t->next_bits = min_bits + 1;
+  t->free_limit = 1 << t->next_bits;
+  t->used = true;
+  entryget(t);
+  t->used = true;
+}
+
+static void entrylink(CArcTab *t, i64 e, i64 base, u8 ch) {
+  CArcEnt *n = t->ent + e;
+  n->basecode = base;
+  n->ch = ch;
+  n->prev = 0;
+  n->linked = true;
+  if ((n->next = t->hash[base]))
+    t->ent[n->next].prev = e;
+  t->hash[base] = e;
+  t->kids[base / 64] |= 1ul << base % 64;
+}
+
+/* callers leave room for a u32 past the last code */
+static void orbits(u8 *p, u64 pos, u32 v) {
+  u32 w;
+  p += pos >> 3;
+  memcpy(&w, p, 4);
+  w |= v << (pos & 7);
+  memcpy(p, &w, 4);
+}
+
+static u32 getbits(CArcX *x, i64 n) {
+  u64 b = x->src_pos >> 3, w = 0;
+  /* the last few bytes of the arc can't take an 8 byte load */
+  if (verylikely(b + 8 <= x->src_size >> 3))
+    memcpy(&w, x->src + b, 8);
+  else
+    memcpy(&w, x->src + b, (x->src_size >> 3) - b);
+  w >>= x->src_pos & 7;
+  x->src_pos += n;
+  return w & ((1u << n) - 1);
+}
+
+static i64 strsz(CArcX *x, i64 code) {
+  return code < x->t.min_tab ? 1 : x->len[code];
+}
+
+static bool push(CArcX *x, u8 c) {
+  /* only a cycle in a corrupt table gets this deep */
+  if (veryunlikely(x->sp == ARC_ENTS))
+    return false;
+  x->stk[x->sp++] = c;
+  return true;
+}
+
+CArcX *ArcXNew(u8 const *arc) {
+  u64 csz, esz;
+  u8 ct = arc[16];
+  if (ct != CT_7_BIT && ct != CT_8_BIT)
+    return NULL;
+  CArcX *x = calloc(1, sizeof *x);
+  if (veryunlikely(!x))
+    return NULL;
+  memcpy(&csz, arc, 8);
+  memcpy(&esz, arc + 8, 8);
+  tabinit(&x->t, ct);
+  x->src = arc;
+  x->src_pos = ARC_HDR_SZ * 8;
+  x->src_size = csz << 3;
+  x->left = esz;
+  x->saved = -1;
+  return x;
+}
+
+/* ArcExpandBuf() */
+i64 ArcXRead(CArcX *x, u8 *dst, i64 len) {
+  CArcTab *t = &x->t;
+  u8 *d = dst, *lim = dst + Min((u64)len, x->left);
+  i64 last, base, code;
+  while (d < lim && x->sp)
+    *d++ = x->stk[--x->sp];
+  if (!x->sp && d < lim) {
+    if (x->saved == -1) {
+      if (veryunlikely(x->src_pos + t->next_bits > x->src_size))
+        return -1;
+      last = getbits(x, t->next_bits);
+      *d++ = last;
+      entryget(t);
+      x->last_ch = last;
+    } else
+      last = x->saved;
+    while (d < lim && x->src_pos + t->next_bits <= x->src_size) {
+      base = getbits(x, t->next_bits);
+      bool kwk = t->cur == base;
+      i64 n = kwk ? strsz(x, last) + 1 : strsz(x, base);
+      /* the stack's empty here, if the whole string fits write it straight
+       * out back to front instead of bouncing it off the stack */
+      if (verylikely(n <= lim - d)) {
+        u8 *p = d + n;
+        if (kwk) {
+          *--p = x->last_ch;
+          code = last;
+        } else
+          code = base;
+        for (; code >= t->min_tab; code = t->ent[code].basecode) {
+          if (veryunlikely(p <= d + 1))
+            return -1;
+          *--p = t->ent[code].ch;
+        }
+        if (veryunlikely(p != d + 1))
+          return -1;
+        *--p = code;
+        d += n;
+      } else {
+        if (kwk) {
+          if (!push(x, x->last_ch))
+            return -1;
+          code = last;
+        } else
+          code = base;
+        for (; code >= t->min_tab; code = t->ent[code].basecode)
+          if (!push(x, t->ent[code].ch))
+            return -1;
+        if (!push(x, code))
+          return -1;
+      }
+      x->last_ch = code;
+      t->used = true;
+      x->len[t->cur] = strsz(x, last) + 1;
+      entrylink(t, t->cur, last, x->last_ch);
+      entryget(t);
+      while (d < lim && x->sp)
+        *d++ = x->stk[--x->sp];
+      last = base;
+    }
+    x->saved = last;
+  }
+  x->left -= d - dst;
+  return d - dst;
+}
+
+void ArcXDel(CArcX *x) {
+  free(x);
+}
+
+bool ArcExpand(u8 const *arc, u8 *dst) {
+  i64 sz, n;
+  CArcX *x = ArcXNew(arc);
+  if (veryunlikely(!x))
+    return false;
+  memcpy(&sz, arc + 8, 8);
+  n = ArcXRead(x, dst, sz);
+  ArcXDel(x);
+  if (veryunlikely(n == -1))
+    return false;
+  memset(dst + n, 0, sz - n);
+  return true;
+}
+
+/* CompressBuf(), ArcCompressBuf() and ArcFinishCompression() */
+u64 ArcCompress(u8 *dst, u8 const *src, u64 size) {
+  u64 dst_pos = ARC_HDR_SZ * 8, dst_size = (size + ARC_HDR_SZ) * 8, p = 0,
+      csz = size + ARC_HDR_SZ;
+  u8 ct = CT_7_BIT;
+  for (u64 i = 0; i < size; i++)
+    if (src[i] & 0x80) {
+      ct = CT_8_BIT;
+      break;
+    }
+  /* an empty buf is stored, same as the HolyC */
+  CArcTab *t = size ? calloc(1, sizeof *t) : NULL;
+  if (t) {
+    tabinit(t, ct);
+    i64 base = src[p++], ch;
+    while (p < size && dst_pos + t->cur_bits <= dst_size) {
+      entryget(t);
+      for (;;) {
+        if (p >= size)
+          goto done;
+        ch = src[p++];
+        u16 e = t->hash[base];
+        while (e && t->ent[e].ch != ch)
+          e = t->ent[e].next;
+        if (!e)
+          break;
+        base = e;
+      }
+      orbits(dst, dst_pos, base);
+      dst_pos += t->cur_bits;
+      t->used = true;
+      entrylink(t, t->cur, base, ch);
+      base = ch;
+    }
+  done:
+    if (p == size && dst_pos + t->cur_bits <= dst_size) {
+      orbits(dst, dst_pos, base);
+      dst_pos += t->next_bits;
+      csz = (dst_pos + 7) >> 3;
+    } else
+      ct = CT_NONE;
+    free(t);
+  } else
+    ct = CT_NONE;
+  if (ct == CT_NONE)
+    memcpy(dst + ARC_HDR_SZ, src, size);
+  memcpy(dst, &csz, 8);
+  memcpy(dst + 8, &size, 8);
+  dst[16] = ct;
+  return csz;
+}
+
+/* CITATIONS:
+ * [1] https://en.wikipedia.org/wiki/Lempel%E2%80%93Ziv%E2%80%93Welch
+ */
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <exodus/types.h>
+
+/* TempleOS's CArcCompress LZW (.Z files), bit for bit what
+ * T/Kernel/COMPRESS.HC reads and writes, q.v. arc.c */
+
+/* sizeof(CArcCompress), HolyC classes aren't padded */
+#define ARC_HDR_SZ 17
+
+typedef struct CArcX CArcX;
+
+/* streaming expander over a whole CArcCompress,
+ * NULL if it isn't CT_7_BIT/CT_8_BIT */
+CArcX *ArcXNew(u8 const *arc);
+/* next len bytes of the expanded data, returns how many were written
+ * (less than len only at the end) or -1 on corrupt input */
+i64 ArcXRead(CArcX *x, u8 *dst, i64 len);
+void ArcXDel(CArcX *x);
+/* expanded_size bytes into dst, false on corrupt input,
+ * zero fills whatever a short stream doesn't cover */
+bool ArcExpand(u8 const *arc, u8 *dst);
+/* CompressBuf(): dst is size + ARC_HDR_SZ + 8 zeroed bytes, gets a whole
+ * CArcCompress (stored as CT_NONE if LZW doesn't pay off),
+ * returns its compressed_size */
+u64 ArcCompress(u8 *dst, u8 const *src, u64 size);
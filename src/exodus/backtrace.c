@@ -8,61 +8,121 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <vec/vec.h>
-
 #include <exodus/backtrace.h>
 #include <exodus/loader.h>
 #include <exodus/misc.h>
 
-static vec_str_t sortedsyms;
+typedef struct {
+  u8 *start;
+  char const *name; /* interned by symtab, never freed */
+} CAddrSym;
+
+/* Address-sorted copy of the symbol table so lookups are a binary search
+ * instead of a walk over every symbol.
+ *
+ * Lookups happen in signal handlers (crash dumps, the profiler), so they
+ * can't malloc or spin on a lock the interrupted code might hold. There are
+ * two copies. SymIdxSync() rebuilds the one not published, after its
+ * readers have left, then publishes it. A lookup just pins the published
+ * copy with a reader count. The symbol table only changes while loading,
+ * so a lookup that races a rebuild uses the previous copy. */
+typedef struct {
+  CAddrSym *syms;
+  u64 cnt, cap, gen;
+  _Atomic(u64) readers;
+} CAddrIdx;
+
+static CAddrIdx idxs[2];
+static CAddrIdx *_Atomic idx;
+static bool synclock;
+
 static char const unknown[] = "UNKNOWN";
 
 static int compar(void const *_a, void const *_b) {
-  char *const *a = _a, *const *b = _b;
-  CSymbol *as = map_get(&symtab, *a);
-  CSymbol *bs = map_get(&symtab, *b);
-  /* this is ok because vals are in signed int bit range */
-  return (i64)as->val - (i64)bs->val;
+  CAddrSym const *a = _a, *b = _b;
+  return (a->start > b->start) - (a->start < b->start);
 }
 
-static void sortsyms(void) {
-  static bool init = false;
-  if (init)
+void SymIdxSync(void) {
+  u64 gen = SymGen();
+  CAddrIdx *cur = __atomic_load_n(&idx, __ATOMIC_ACQUIRE);
+  if (verylikely(cur && cur->gen == gen))
     return;
-  map_iter_t it = map_iter(&symtab);
-  char *k;
-  while ((k = map_next(&symtab, &it)))
-    vec_push(&sortedsyms, k);
-  qsort(sortedsyms.data, sortedsyms.length, sizeof(char *), compar);
-  init = true;
+  while (LBts(&synclock, 0))
+    while (Bt(&synclock, 0))
+      __builtin_ia32_pause();
+  cur = __atomic_load_n(&idx, __ATOMIC_ACQUIRE);
+  CAddrIdx *nu = cur == idxs ? idxs + 1 : idxs;
+  /* a handler on this thread always leaves before we get to run again */
+  while (__atomic_load_n(&nu->readers, __ATOMIC_ACQUIRE))
+    __builtin_ia32_pause();
+  if (nu->cap < SymCnt()) {
+    free(nu->syms);
+    nu->cap = SymCnt();
+    nu->syms = malloc(nu->cap * sizeof *nu->syms);
+  }
+  nu->cnt = 0;
+  u64 it = 0;
+  char const *k;
+  CSymbol *sym;
+  while ((k = SymNext(&it, &sym))) {
+    /* imports don't have an address */
+    if (sym->type != HTT_EXPORT_SYS_SYM && sym->type != HTT_FUN)
+      continue;
+    nu->syms[nu->cnt++] = (CAddrSym){
+        .start = sym->val,
+        .name = k,
+    };
+  }
+  qsort(nu->syms, nu->cnt, sizeof *nu->syms, compar);
+  nu->gen = gen;
+  __atomic_store_n(&idx, nu, __ATOMIC_RELEASE);
+  LBtr(&synclock, 0);
+}
+
+char const *WhichFunOff(u8 *ptr, u64 *off) {
+  CAddrIdx *cur;
+  /* pin it, then make sure it wasn't swapped out from under us */
+  while ((cur = __atomic_load_n(&idx, __ATOMIC_ACQUIRE))) {
+    __atomic_fetch_add(&cur->readers, 1, __ATOMIC_ACQ_REL);
+    if (verylikely(cur == __atomic_load_n(&idx, __ATOMIC_ACQUIRE)))
+      break;
+    __atomic_fetch_sub(&cur->readers, 1, __ATOMIC_RELEASE);
+  }
+  if (veryunlikely(!cur))
+    return NULL;
+  /* find the last symbol that starts at or before ptr */
+  u64 lo = 0, hi = cur->cnt, mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (cur->syms[mid].start <= ptr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  CAddrSym *s = lo ? cur->syms + lo - 1 : NULL;
+  __atomic_fetch_sub(&cur->readers, 1, __ATOMIC_RELEASE);
+  if (!s)
+    return NULL;
+  if (off)
+    *off = ptr - s->start;
+  return s->name;
 }
 
 void BackTrace(u64 _rbp, u64 _rip) {
-  sortsyms();
   fputc('\n', stderr);
-  u8 *rbp = (u8 *)_rbp, *ptr = (u8 *)_rip, *oldp, *curp, **tmp;
-  char const *last = unknown, *s;
-  int iter;
-  CSymbol *sym;
+  u8 *rbp = (u8 *)_rbp, *ptr = (u8 *)_rip, **tmp;
+  char const *s;
+  u64 off;
   while (rbp) {
-    oldp = NULL;
-    last = unknown;
-    // iterates over symbols in order to find out where we are
-    vec_foreach(&sortedsyms, s, iter) {
-      sym = map_get(&symtab, s);
-      curp = sym->val;
-      if (curp >= ptr) {
-        /* Note: if the numbers are wildly off the norm then it's probably:
-         * 1) stack corruption
-         * 2) some jit'd user cmd line code */
-        /* function name [function addr+offset from rip] (%rip) */
-        flushprint(stderr, "%s [%p+%#jx] (%p)\n", last, ptr, ptr - oldp, curp);
-        goto next;
-      }
-      oldp = curp;
-      last = s;
-    }
-  next:
+    /* Note: if the numbers are wildly off the norm then it's probably:
+     * 1) stack corruption
+     * 2) some jit'd user cmd line code */
+    /* function name [function addr+offset from rip] (%rip) */
+    if ((s = WhichFunOff(ptr, &off)))
+      flushprint(stderr, "%s [%p+%#jx] (%p)\n", s, ptr - off, off, ptr);
+    else
+      flushprint(stderr, "%s (%p)\n", unknown, ptr);
     tmp = (u8 **)rbp;
     ptr = tmp[1], rbp = tmp[0];
     /* x86_64 stk
@@ -82,15 +142,6 @@ void BackTrace(u64 _rbp, u64 _rip) {
 
 /* (gdb) p (char*)WhichFun($pc) */
 __attribute__((used, visibility("default"))) char const *WhichFun(u8 *ptr) {
-  sortsyms();
-  char const *last = unknown, *s;
-  int iter;
-  CSymbol *sym;
-  vec_foreach(&sortedsyms, s, iter) {
-    sym = map_get(&symtab, s);
-    if (sym->val >= ptr)
-      return s;
-    last = s;
-  }
-  return last;
+  SymIdxSync();
+  return WhichFunOff(ptr, NULL) ?: unknown;
 }
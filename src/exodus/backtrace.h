@@ -3,3 +3,9 @@
 #include <exodus/types.h>
 
 void BackTrace(u64 _rbp, u64 _rip);
+/* name of the symbol containing ptr, NULL if unknown
+ * off (optional): ptr - symbol addr
+ * async-signal-safe, only sees symbols as of the last SymIdxSync() */
+char const *WhichFunOff(u8 *ptr, u64 *off);
+/* catch WhichFunOff() up with the symbol table, not async-signal-safe */
+void SymIdxSync(void);
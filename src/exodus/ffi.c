@@ -3,6 +3,12 @@
 // Copyright 2024 1fishe2fishe
 // Refer to the LICENSE file for license info.
 // Any citation links are provided at the end of the file.
+#ifdef __linux__
+  #include <pthread.h>
+  #include <sys/epoll.h>
+  #include <unistd.h>
+#endif
+#include <errno.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -13,10 +19,14 @@
 #include <isocline.h>
 
 #include <exodus/abi.h>
+#include <exodus/aio.h>
 #include <exodus/alloc.h>
+#include <exodus/arc.h>
+#include <exodus/hdrcache.h>
 #include <exodus/loader.h>
 #include <exodus/main.h>
 #include <exodus/misc.h>
+#include <exodus/profiler.h>
 #include <exodus/seth.h>
 #include <exodus/shims.h>
 #include <exodus/sound.h>
@@ -24,21 +34,22 @@
 #include <exodus/types.h>
 #include <exodus/vfs.h>
 #include <exodus/window.h>
+#include <exodus/workq.h>
 #include <exodus/x86.h>
 
 /* HolyC -> C FFI */
 void HolyFree(void *ptr) {
-  static CSymbol *sym;
-  if (!sym)
-    sym = map_get(&symtab, "_FREE");
-  fficall(sym->val, ptr);
+  static void *fp;
+  if (!fp)
+    fp = SymFind("Free")->val;
+  fficall(fp, ptr);
 }
 
 void *HolyMAlloc(u64 sz) {
-  static CSymbol *sym;
-  if (!sym)
-    sym = map_get(&symtab, "_MALLOC");
-  return (void *)fficall(sym->val, sz, NULL);
+  static void *fp;
+  if (!fp)
+    fp = SymFind("MAlloc")->val;
+  return (void *)fficall(fp, sz, NULL);
 }
 
 void *HolyCAlloc(u64 sz) {
@@ -50,12 +61,12 @@ char *HolyStrDup(char const *str) {
 }
 
 noret void HolyThrow(char const *s) {
-  static CSymbol *sym;
+  static void *fp;
   u64 i = 0;
   __builtin_memcpy(&i, s, Min(strlen(s), 8ul));
-  if (!sym)
-    sym = map_get(&symtab, "throw");
-  fficall(sym->val, i);
+  if (!fp)
+    fp = SymFind("throw")->val;
+  fficall(fp, i);
   Unreachable();
 }
 
@@ -112,28 +123,161 @@ static void genthunks(HolyFFI *list, i64 cnt) {
                               .fp = (void *)INT64_MAX,
                               .arity = INT16_MAX,
                           });
-  u8 *blob = NewVirtualChunk(sz * cnt, true), *prev;
+  /* stable addresses let cached kernel images skip repatching FFI imports */
+  u8 *blob = NewVirtualChunkAt((void *)FFI_THUNK_BASE, sz * cnt, true)
+         ?: NewVirtualChunk(sz * cnt, true),
+     *prev;
   if (veryunlikely(!blob)) {
     flushprint(stderr, "Can't allocate space for FFI function pointers\n");
     terminate(1);
   }
   for (HolyFFI *cur = list; cur != list + cnt; cur++) {
     blob += genthunk(prev = blob, cur);
-    map_set(&symtab, cur->name, (CSymbol){.type = HTT_FUN, .val = prev});
+    SymSet(cur->name, (CSymbol){.type = HTT_FUN, .val = prev});
   }
 }
 
 /* C -> HolyC FFI */
+/* dyad's state is per host thread (one per core) */
+static _Thread_local bool dyadinit;
+
 static void STK_DyadInit(argign void *args) {
-  static bool init;
-  if (init)
+  if (dyadinit)
     return;
-  init = true;
+  dyadinit = true;
   dyad_init();
   dyad_setUpdateTimeout(0.);
 }
 
+/* streams are only polled on a thread that ran dyad_init() */
+static dyad_Stream *STK_DyadNewStream(argign void *args) {
+  STK_DyadInit(NULL);
+  return dyad_newStream();
+}
+
+static void STK_DyadShutdown(argign void *args) {
+  if (!dyadinit)
+    return;
+  dyadinit = false;
+  dyad_shutdown();
+}
+
+/* DyadWait() parks the calling task rather than sitting in epoll_wait(2)
+ * with the whole core. One host thread watches every core's dyad epoll fd
+ * (EPOLLONESHOT, re-armed by each DyadArm()) and when one reads ready it
+ * zeroes the parked task's wake_jiffy and kicks the core, like aiodone()
+ * does. The cmpxchg expects the deadline the task parked with, and
+ * DyadDisarm() takes the mutex, so once it returns the watcher is done
+ * with that wake_jiffy. Elsewhere DyadArm() fails and DyadWait() polls */
+#ifdef __linux__
+typedef struct {
+  pthread_mutex_t mtx;
+  i64 *wake, val;
+} CDyadWake;
+
+static struct {
+  pthread_once_t once;
+  int fd;
+  CDyadWake cores[MP_PROCESSORS_NUM];
+} dyadwatch = {.once = PTHREAD_ONCE_INIT, .fd = -1};
+
+/* mtx must be held, true if the task was still parked */
+static bool dyadwake(CDyadWake *w) {
+  i64 val = w->val;
+  bool woke = w->wake && __atomic_compare_exchange_n(w->wake, &val, 0, false,
+                                                     __ATOMIC_ACQ_REL,
+                                                     __ATOMIC_RELAXED);
+  __atomic_store_n(&w->wake, NULL, __ATOMIC_RELAXED);
+  return woke;
+}
+
+/* a stream on this core was written to or closed, let its DyadWait()
+ * caller flush it, we're on its core so no WakeCoreUp() */
+static void dyadkick(void) {
+  CDyadWake *w = dyadwatch.cores + CoreNum();
+  /* only this core arms w */
+  if (!__atomic_load_n(&w->wake, __ATOMIC_RELAXED))
+    return;
+  pthread_mutex_lock(&w->mtx);
+  dyadwake(w);
+  pthread_mutex_unlock(&w->mtx);
+}
+
+static void *dyadwatcher(argign void *arg) {
+  struct epoll_event evs[16];
+  while (true) {
+    int n = epoll_wait(dyadwatch.fd, evs, 16, -1);
+    for (int i = 0; i < n; i++) {
+      CDyadWake *w = evs[i].data.ptr;
+      pthread_mutex_lock(&w->mtx);
+      bool woke = dyadwake(w);
+      pthread_mutex_unlock(&w->mtx);
+      if (woke)
+        WakeCoreUp(w - dyadwatch.cores);
+    }
+  }
+  return NULL;
+}
+
+static void dyadwatchinit(void) {
+  for (u64 i = 0; i < MP_PROCESSORS_NUM; i++)
+    pthread_mutex_init(&dyadwatch.cores[i].mtx, NULL);
+  if (-1 == (dyadwatch.fd = epoll_create1(EPOLL_CLOEXEC)))
+    return;
+  pthread_t t;
+  if (!pthread_create(&t, NULL, dyadwatcher, NULL)) {
+    pthread_setname_np(t, "Dyad watcher");
+    return;
+  }
+  close(dyadwatch.fd);
+  dyadwatch.fd = -1;
+}
+
+static void STK_DyadDisarm(i64 **stk) {
+  CDyadWake *w = dyadwatch.cores + CoreNum();
+  if (__atomic_load_n(&w->wake, __ATOMIC_RELAXED) != stk[0])
+    return;
+  pthread_mutex_lock(&w->mtx);
+  if (w->wake == stk[0])
+    __atomic_store_n(&w->wake, NULL, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&w->mtx);
+}
+
+/* zero *wake (if it's still val) once this core's streams need a
+ * DyadUpdate, false if there's nothing to watch with */
+static i64 STK_DyadArm(i64 **stk) {
+  pthread_once(&dyadwatch.once, dyadwatchinit);
+  int fd = dyad_getPollFd();
+  if (dyadwatch.fd == -1 || fd == -1)
+    return false;
+  CDyadWake *w = dyadwatch.cores + CoreNum();
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = w};
+  pthread_mutex_lock(&w->mtx);
+  w->val = (i64)stk[1];
+  __atomic_store_n(&w->wake, stk[0], __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&w->mtx);
+  /* a closed epoll fd leaves the set by itself, so after a DyadShutdown()
+   * and DyadInit() the new one has to be added again */
+  if (!epoll_ctl(dyadwatch.fd, EPOLL_CTL_MOD, fd, &ev) ||
+      (errno == ENOENT && !epoll_ctl(dyadwatch.fd, EPOLL_CTL_ADD, fd, &ev)))
+    return true;
+  STK_DyadDisarm(stk);
+  return false;
+}
+#else
+static void dyadkick(void) {
+}
+
+static void STK_DyadDisarm(argign void *args) {
+}
+
+static i64 STK_DyadArm(argign void *args) {
+  return false;
+}
+#endif
+
 static i64 STK_DyadListen(i64 *stk) {
+  dyad_setReusePort((dyad_Stream *)stk[0], stk[3]);
   return dyad_listenEx((dyad_Stream *)stk[0], (char *)stk[2], stk[1], 511);
 }
 
@@ -143,14 +287,22 @@ static i64 STK_DyadConnect(i64 *stk) {
 
 static void STK_DyadWrite(i64 *stk) {
   dyad_write((dyad_Stream *)stk[0], (void *)stk[1], (int)stk[2]);
+  dyadkick();
+}
+
+static void STK_DyadCloseServer(dyad_Stream **stk) {
+  dyad_closeServer(stk[0]);
+  dyadkick();
 }
 
 static void STK_DyadEnd(dyad_Stream **stk) {
   dyad_end(stk[0]);
+  dyadkick();
 }
 
 static void STK_DyadClose(dyad_Stream **stk) {
   dyad_close(stk[0]);
+  dyadkick();
 }
 
 static char *STK_DyadGetAddress(dyad_Stream **stk) {
@@ -236,16 +388,20 @@ static void STK_InterruptCore(u64 *stk) {
 }
 
 static void STK___BootstrapForeachSymbol(void **stk) {
-  map_iter_t it = map_iter(&symtab);
-  char *k;
+  u64 it = 0;
+  char const *k;
   CSymbol *v;
-  while ((k = map_next(&symtab, &it))) {
-    v = map_iter_val(&symtab, &it);
+  while ((k = SymNext(&it, &v))) {
     fficall(stk[0], k, v->val,
             v->type == HTT_EXPORT_SYS_SYM ? HTT_FUN : v->type);
   }
 }
 
+static u8 *STK___SymFind(char **stk) {
+  CSymbol *sym = SymFind(stk[0]);
+  return sym ? sym->val : NULL;
+}
+
 /* HolyC ABI is stdcall (callee cleans up its own stack)
  * so we need RET1 to pop args(ret imm16)
  * variadics are cdecl
@@ -274,6 +430,14 @@ static void STK_DrawWindowUpdate(u8 **stk) {
   DrawWindowUpdate(stk[0]);
 }
 
+static u64 STK_ScrnDirtyTiles(void **stk) {
+  return ScrnDirtyTiles(stk[0], stk[1]);
+}
+
+static void STK_DrawWindowUpdateTiles(void **stk) {
+  DrawWindowUpdateTiles(stk[0], stk[1]);
+}
+
 static void STK_SetKBCallback(void **stk) {
   SetKBCallback(stk[0]);
 }
@@ -290,6 +454,22 @@ static void STK___Sleep(u64 *stk) {
   SleepMillis(stk[0]);
 }
 
+static void STK___WakeAt(i64 *stk) {
+  WakeAtJiffy(stk[0]);
+}
+
+static u64 STK___WorkPush(void **stk) {
+  return WorkPush(stk[0]);
+}
+
+static void *STK___WorkPop(argign void *stk) {
+  return WorkPop();
+}
+
+static void *STK___WorkSteal(argign void *stk) {
+  return WorkSteal();
+}
+
 static void STK_SndFreq(u64 *stk) {
   SndFreq(stk[0]);
 }
@@ -332,13 +512,40 @@ static void STK___SpawnCore(void **stk) {
 }
 
 static void *STK_NewVirtualChunk(u64 *stk) {
-  return NewVirtualChunk(stk[0], stk[1]);
+  return HdrCacheAlloc(stk[0]) ?: NewVirtualChunk(stk[0], stk[1]);
+}
+
+static u64 STK_VirtualChunkSz(u64 *stk) {
+  return VirtualChunkSz(stk[0]);
+}
+
+static void STK_HugePagesStats(u64 *stk) {
+  HugePagesStats((u64 *)stk[0]);
 }
 
 static void STK_FreeVirtualChunk(u64 *stk) {
+  /* pages in the header cache arena are never given back */
+  if (HdrCacheOwns((void *)stk[0]))
+    return;
   FreeVirtualChunk((void *)stk[0], stk[1]);
 }
 
+static u8 *STK_HdrCacheLoad(u64 *stk) {
+  return HdrCacheLoad(stk[0]);
+}
+
+static u8 *STK_HdrCacheBegin(u64 *stk) {
+  return HdrCacheBegin(stk[0]);
+}
+
+static void STK_HdrCacheEnd(u64 *stk) {
+  HdrCacheEnd((u8 *)stk[0], stk[1]);
+}
+
+static u64 STK_HdrCacheOwns(void **stk) {
+  return HdrCacheOwns(stk[0]);
+}
+
 static void STK_VFsSetPwd(char **stk) {
   VFsSetPwd(stk[0]);
 }
@@ -363,6 +570,14 @@ static u8 *STK_VFsFRead(u64 *stk) {
   return VFsFRead((char *)stk[0], (u64 *)stk[1]);
 }
 
+static u8 *STK_VFsFMap(u64 *stk) {
+  return VFsFMap((char *)stk[0], (u64 *)stk[1]);
+}
+
+static u64 STK_VFsFUnmap(void **stk) {
+  return VFsFUnmap(stk[0]);
+}
+
 static u64 STK_VFsFWrite(char **stk) {
   return VFsFWrite(stk[0], (u8 const *)stk[1], (u64)stk[2]);
 }
@@ -375,6 +590,10 @@ static char **STK_VFsDir(argign void *stk) {
   return VFsDir();
 }
 
+static CVDirEntry *STK_VFsDirStat(argign void *stk) {
+  return VFsDirStat();
+}
+
 static u64 STK_VFsDel(char **stk) {
   return VFsDel(stk[0]);
 }
@@ -388,7 +607,11 @@ static i64 STK_VFsFOpenR(char **stk) {
 }
 
 static void STK_VFsFClose(int *stk) {
-  closefd(stk[0]);
+  VFsFClose(stk[0]);
+}
+
+static i64 STK_VFsFdSize(i64 *stk) {
+  return VFsFdSize(stk[0]);
 }
 
 static u64 STK_VFsFBlkRead(i64 *stk) {
@@ -398,9 +621,37 @@ static u64 STK_VFsFBlkRead(i64 *stk) {
 
 static u64 STK_VFsFBlkWrite(i64 *stk) {
   i64 towrite = stk[1] * stk[2];
+  VFsTouched();
   return towrite == writefd(stk[3], (void *)stk[0], towrite);
 }
 
+static void STK_AioSubmit(u64 *stk) {
+  if (stk[5])
+    VFsTouched();
+  AioSubmit((CAioReq *)stk[0], stk[1], (u8 *)stk[2], stk[3], stk[4], stk[5],
+            (i64 *)stk[6]);
+}
+
+static u64 STK_ArcExpand(u8 **stk) {
+  return ArcExpand(stk[0], stk[1]);
+}
+
+static u64 STK_ArcCompress(u64 *stk) {
+  return ArcCompress((u8 *)stk[0], (u8 *)stk[1], stk[2]);
+}
+
+static CArcX *STK_ArcXNew(u8 **stk) {
+  return ArcXNew(stk[0]);
+}
+
+static i64 STK_ArcXRead(u64 *stk) {
+  return ArcXRead((CArcX *)stk[0], (u8 *)stk[1], stk[2]);
+}
+
+static void STK_ArcXDel(CArcX **stk) {
+  ArcXDel(stk[0]);
+}
+
 static u64 STK_VFsFSeek(i64 *stk) {
   return seekfd(stk[1], stk[0]);
 }
@@ -425,6 +676,10 @@ static i64 STK_HPET(argign u64 *stk) {
   return getticksus() * 14; // 14MHz
 }
 
+static u64 STK_SysTimerRead(argign u64 *stk) {
+  return SysTimerRead();
+}
+
 static void STK_Exit(int *stk) {
   terminate(stk[0]);
 }
@@ -531,6 +786,18 @@ static void STK_MPSetProfilerInt(i64 *stk) {
   MPSetProfilerInt((void *)stk[0], stk[1], stk[2]);
 }
 
+static void STK_ProfSamplerStart(i64 *stk) {
+  ProfStart(stk[0]);
+}
+
+static void STK_ProfSamplerStop(argign void *stk) {
+  ProfStop();
+}
+
+static u8 *STK_ProfSamplerDump(i64 *stk) {
+  return ProfDump(stk[0], (u64 *)stk[1], (u64 *)stk[2]);
+}
+
 void BootstrapLoader(void) {
 #define R(h, c, a) {.name = h, .fp = c, .arity = a}
 #define S(h, a) \
@@ -539,6 +806,9 @@ void BootstrapLoader(void) {
       R("__CmdLineBootText", CmdLineBootText, 0),
       R("__CoreNum", CoreNum, 0),
       S(MPSetProfilerInt, 3),
+      S(ProfSamplerStart, 1),
+      S(ProfSamplerStop, 0),
+      S(ProfSamplerDump, 3),
       R("mp_cnt", mp_cnt, 0),
       R("MPIntsInit", InitIRQ0, 0),
       R("__IsCmdLine", IsCmdLine, 0),
@@ -548,6 +818,12 @@ void BootstrapLoader(void) {
       S(InterruptCore, 1),
       S(NewVirtualChunk, 2),
       S(FreeVirtualChunk, 2),
+      S(VirtualChunkSz, 1),
+      S(HugePagesStats, 1),
+      S(HdrCacheLoad, 1),
+      S(HdrCacheBegin, 1),
+      S(HdrCacheEnd, 2),
+      S(HdrCacheOwns, 1),
       R("Shutdown", STK_Exit, 1),
       S(__GetStr, 1),
       S(FUnixTime, 1),
@@ -555,11 +831,21 @@ void BootstrapLoader(void) {
       S(SetClipboardText, 1),
       S(SndFreq, 1),
       S(__Sleep, 1),
+      S(__WakeAt, 1),
       S(__AwakeCore, 1),
+      S(__WorkPush, 1),
+      S(__WorkPop, 0),
+      S(__WorkSteal, 0),
       S(SetKBCallback, 1),
       S(SetMSCallback, 1),
       S(__BootstrapForeachSymbol, 1),
+      S(__SymFind, 1),
       S(DrawWindowUpdate, 1),
+      S(ScrnDirtyTiles, 2),
+      S(DrawWindowUpdateTiles, 2),
+      R("ScrnFramesPresented", ScrnFramesPresented, 0),
+      R("ScrnFramesDropped", ScrnFramesDropped, 0),
+      R("ScrnFrameBegin", ScrnFrameBegin, 0),
       R("DrawWindowNew", DrawWindowNew, 0),
       R("PCSpkInit", PCSpkInit, 0),
       S(UnblockSignals, 0),
@@ -572,13 +858,16 @@ void BootstrapLoader(void) {
       //
       S(DyadInit, 0),
       R("DyadUpdate", dyad_update, 0),
-      R("DyadShutdown", dyad_shutdown, 0),
-      R("DyadNewStream", dyad_newStream, 0),
-      S(DyadListen, 3),
+      S(DyadArm, 2),
+      S(DyadDisarm, 1),
+      S(DyadShutdown, 0),
+      S(DyadNewStream, 0),
+      S(DyadListen, 4),
       S(DyadConnect, 3),
       S(DyadWrite, 3),
       S(DyadEnd, 1),
       S(DyadClose, 1),
+      S(DyadCloseServer, 1),
       S(DyadGetAddress, 1),
       S(_DyadGetCallbackMode, 1),
       S(DyadSetReadCallback, 4),
@@ -623,17 +912,28 @@ void BootstrapLoader(void) {
       S(VFsFSize, 1),
       S(VFsFRead, 2),
       S(VFsFWrite, 3),
+      S(VFsFMap, 2),
+      S(VFsFUnmap, 1),
       S(VFsDel, 1),
       S(VFsDir, 0),
+      S(VFsDirStat, 0),
       S(VFsDirMk, 1),
       S(VFsFBlkRead, 4),
       S(VFsFBlkWrite, 4),
       S(VFsFOpenW, 1),
       S(VFsFOpenR, 1),
       S(VFsFClose, 1),
+      S(VFsFdSize, 1),
       S(VFsFSeek, 2),
+      S(AioSubmit, 7),
+      S(ArcExpand, 2),
+      S(ArcCompress, 3),
+      S(ArcXNew, 1),
+      S(ArcXRead, 3),
+      S(ArcXDel, 1),
       S(VFsSetDrv, 1),
       S(HPET, 0),
+      S(SysTimerRead, 0),
       R("VFsGetDrv", VFsGetDrv, 0),
       S(SetVolume, 1),
       S(GetVolume, 0),
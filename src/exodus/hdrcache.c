@@ -0,0 +1,155 @@
+// vi: set et ft=c ts=2 sts=2 sw=2 fenc=utf-8 :vi
+//
+// Copyright 2024 1fishe2fishe
+// Refer to the LICENSE file for license info.
+// Any citation links are provided at the end of the file.
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <exodus/alloc.h>
+#include <exodus/hdrcache.h>
+#include <exodus/loader.h>
+#include <exodus/misc.h>
+#include <exodus/shims.h>
+#include <exodus/types.h>
+
+/* Boot cache
+ *
+ * Before doing anything useful every boot compiles KernelA.HH into adam's hash
+ * table, binds it against the host's symbols, compiles KernelB.HH and reads
+ * HCRT.DBG.Z on top (BootImps in FULL_PACKAGE.HC). Serializing the
+ * CHashClass/CHashFun/... graph that comes out of that would mean teaching C
+ * about every compiler struct (and the interior pointers PrsClassNew() hands
+ * out for Foo*, Foo**), so instead it runs on a fresh heap whose pages all come
+ * from one arena at HDRCACHE_BASE. Every byte it allocated is then in
+ * [HDRCACHE_BASE, +used), which gets dumped to <HCRT.BIN>.HDRS and mapped back
+ * (MAP_PRIVATE) next time at the same address, pointers and all. HolyC then
+ * only has to HashAdd the entries.
+ *
+ * This is as much of a boot snapshot as we can restore: Seth cores are host
+ * threads with host stacks, SDL and host fds behind them, none of which can be
+ * mapped back, so the rest of boot (SysGlblsInit, __InitCPUs) still runs.
+ *
+ * The arena is only valid if whatever outside of it it points to hasn't moved:
+ *   - HCRT and the FFI thunks, covered by the loader's key (q.v. LoadHCRT)
+ *   - adam's hash entries that existed before BootImps and HCRT.DBG.Z, covered
+ *     by env which HolyC computes (q.v. HdrCacheEnv)
+ *
+ * layout:
+ *   [CHdrCacheHdr] pad to HDRS_ALIGN
+ *   [arena]        a page of zeroes so mapping it never runs past EOF
+ */
+#define HDRS_MAGIC   "EXOHDRS\0"
+#define HDRS_VERSION 2
+/* NT wants file mapping offsets aligned to allocation granularity */
+#define HDRS_ALIGN   0x10000u
+#define HDRS_PAGE    0x1000u
+/* HCRT.DBG.Z gets decompressed in here too */
+#define HDRS_SZ      MiB(128)
+
+typedef struct {
+  char magic[8];
+  u64 version, key, env;
+  u64 base, used, root;
+} CHdrCacheHdr;
+
+static struct {
+  char path[0x220];
+  u64 key;
+  /* arena, either being recorded into or mapped from the cache */
+  u8 *base;
+  u64 used, sz;
+  bool overflow;
+} hdrs;
+
+/* only the thread running BootImps allocates from the arena. adam's heaps
+ * point at it meanwhile, so FULL_PACKAGE.HC does that before __InitCPUs
+ * starts the other cores */
+static _Thread_local bool recording;
+
+void HdrCacheInit(char const *bin_path, u64 key) {
+  snprintf(hdrs.path, sizeof hdrs.path, "%s.HDRS", bin_path);
+  hdrs.key = key;
+}
+
+u8 *HdrCacheLoad(u64 env) {
+  CHdrCacheHdr hdr;
+  if (!hdrs.key || hdrs.base)
+    return NULL;
+  int fd = openfd(hdrs.path, false);
+  if (fd == -1)
+    return NULL;
+  bool ok = sizeof hdr == readfd(fd, (u8 *)&hdr, sizeof hdr)
+         && !memcmp(hdr.magic, HDRS_MAGIC, 8) && hdr.version == HDRS_VERSION
+         && hdr.key == hdrs.key && hdr.env == env
+         && hdr.base == HDRCACHE_BASE && hdr.used <= HDRS_SZ
+         && hdr.root - hdr.base < hdr.used;
+  closefd(fd);
+  if (!ok)
+    return NULL;
+  u8 *arena = mapfile(hdrs.path, HDRS_ALIGN, hdr.used, (void *)hdr.base);
+  if (!arena)
+    return NULL;
+  hdrs.base = arena;
+  hdrs.sz = hdrs.used = hdr.used;
+  return (u8 *)hdr.root;
+}
+
+u8 *HdrCacheBegin(u64 hdr_sz) {
+  if (!hdrs.key || hdrs.base || hdr_sz > HDRS_SZ)
+    return NULL;
+  if (!(hdrs.base = NewVirtualChunkAt((void *)HDRCACHE_BASE, HDRS_SZ, true)))
+    return NULL;
+  hdrs.sz = HDRS_SZ;
+  hdrs.used = ALIGNNUM(hdr_sz, HDRS_PAGE);
+  hdrs.overflow = false;
+  recording = true;
+  return hdrs.base;
+}
+
+void *HdrCacheAlloc(u64 sz) {
+  if (verylikely(!recording))
+    return NULL;
+  sz = ALIGNNUM(sz, HDRS_PAGE);
+  if (hdrs.used + sz > hdrs.sz) {
+    /* the rest of the parse lands outside the arena, can't save it */
+    hdrs.overflow = true;
+    return NULL;
+  }
+  u8 *ret = hdrs.base + hdrs.used;
+  hdrs.used += sz;
+  return ret;
+}
+
+bool HdrCacheOwns(void *ptr) {
+  return hdrs.base && (u8 *)ptr >= hdrs.base
+      && (u8 *)ptr < hdrs.base + hdrs.sz;
+}
+
+void HdrCacheEnd(u8 *root, u64 env) {
+  if (!recording)
+    return;
+  recording = false;
+  if (!root || hdrs.overflow)
+    return;
+  CHdrCacheHdr hdr = {
+      .magic = HDRS_MAGIC,
+      .version = HDRS_VERSION,
+      .key = hdrs.key,
+      .env = env,
+      .base = (u64)hdrs.base,
+      .used = hdrs.used,
+      .root = (u64)root,
+  };
+  char tmp[0x240];
+  int fd = openscratch(tmp, sizeof tmp, hdrs.path);
+  if (fd == -1)
+    return;
+  u8 pad[HDRS_PAGE] = {0};
+  bool ok = sizeof hdr == writefd(fd, (u8 *)&hdr, sizeof hdr)
+         && seekfd(fd, HDRS_ALIGN)
+         && (i64)hdrs.used == writefd(fd, hdrs.base, hdrs.used)
+         && sizeof pad == writefd(fd, pad, sizeof pad);
+  commitfile(fd, tmp, hdrs.path, ok);
+}
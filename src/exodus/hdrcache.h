@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <exodus/types.h>
+
+/* Boot cache for LoadImps, q.v. hdrcache.c */
+
+/* key 0 disables the cache */
+void HdrCacheInit(char const *bin_path, u64 key);
+/* root saved by HdrCacheEnd() or NULL if there's no usable cache */
+u8 *HdrCacheLoad(u64 env);
+/* start handing this thread's NewVirtualChunk()s out of the arena,
+ * returns hdr_sz bytes at its base or NULL */
+u8 *HdrCacheBegin(u64 hdr_sz);
+/* stop recording and save the arena unless root is NULL */
+void HdrCacheEnd(u8 *root, u64 env);
+/* NULL when this thread isn't recording */
+void *HdrCacheAlloc(u64 sz);
+bool HdrCacheOwns(void *ptr);
@@ -7,17 +7,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#include <map/map.h>
 #include <vec/vec.h>
 
 #include <exodus/alloc.h>
+#include <exodus/backtrace.h>
+#include <exodus/hdrcache.h>
 #include <exodus/loader.h>
 #include <exodus/misc.h>
 #include <exodus/shims.h>
 
-map_sym_t symtab;
-
 /* These routines are just copied from TempleOS and I haven't put much effort in
  * making them pretty */
 static void LoadOneImport(u8 **_src, u8 *module_base);
@@ -33,35 +33,409 @@ typedef struct __attribute__((packed, may_alias)) {
   u8 data[];
 } CBinFile;
 
-vec_void_t LoadHCRT(char const *name) {
-  i64 sz;
-  if (-1 == (sz = fsize(name))) {
+/* Relocated image cache
+ *
+ * Relocation walks the whole patch table and dirties every page of the image,
+ * which is most of what a -c run spends before doing actual work. Once a
+ * relocation succeeds we dump the image together with the symbols it exported
+ * to <HCRT.BIN>.CACHE and on the next launch mmap it back (MAP_PRIVATE) at the
+ * same address so pages only get faulted in when they are touched.
+ *
+ * A relocated image is only valid at the address it was relocated to and
+ * against the FFI thunks it was linked with, hence:
+ *   - the cache is keyed by HCRT.BIN's size and mtime and the set of host
+ *     symbols, so a hit doesn't read HCRT.BIN at all. mtime only has 1s
+ *     granularity, so if HCRT.BIN was modified during the second the cache
+ *     was written (or after it) HCRT.BIN's hash decides, like git's racy
+ *     index entries[1]
+ *   - we try to load the image at HCRT_BASE so the address survives ASLR
+ *   - imports of host symbols (FFI thunks, q.v. genthunks) are recorded and
+ *     repatched on load in case a thunk moved
+ *
+ * layout:
+ *   [CCacheHdr] pad to CACHE_ALIGN
+ *   [image]     pad to CACHE_ALIGN
+ *   [meta]      mains, symbols, host fixups
+ * Every offset and count in there is checked against the file before use.
+ */
+#define CACHE_MAGIC   "EXOCACHE"
+#define CACHE_VERSION 2
+/* NT wants file mapping offsets aligned to allocation granularity */
+#define CACHE_ALIGN   0x10000u
+
+typedef struct {
+  char magic[8];
+  u64 version, bin_hash, host_hash;
+  u64 bin_mtime, saved_at;
+  u64 image_base, image_sz;
+  u64 meta_off, meta_sz;
+  u64 nmains, nsyms, nfixups;
+} CCacheHdr;
+
+/* import of a host symbol patched into the image */
+typedef struct {
+  char const *name; /* points into the patch table */
+  u64 val;
+  u32 off /* from CBinFile.data */, etype;
+} CHostFixup;
+
+static vec_t(CHostFixup) hostfixups;
+static bool recfixups;
+
+/* FNV-1a, 8 bytes at a time */
+static u64 hashbytes(u8 const *p, u64 sz) {
+  u64 h = 0xcbf29ce484222325, w;
+  for (; sz >= 8; p += 8, sz -= 8) {
+    memcpy(&w, p, 8);
+    h = (h ^ w) * 0x100000001b3;
+  }
+  while (sz--)
+    h = (h ^ *p++) * 0x100000001b3;
+  return h;
+}
+
+/* order-independent, iteration order depends on insertion history */
+static u64 hosthash(void) {
+  u64 it = 0, ret = 0;
+  char const *k;
+  CSymbol *sym;
+  while ((k = SymNext(&it, &sym)))
+    ret += hashbytes((u8 *)k, strlen(k));
+  return ret;
+}
+
+/* the compiled header cache points into the image and the FFI thunks */
+static u64 hdrkey(u64 bin_hash, u64 host_hash, void *image) {
+  u64 it = 0, thunks = 0;
+  CSymbol *sym;
+  while (SymNext(&it, &sym))
+    if (sym->type == HTT_FUN)
+      thunks += (u64)sym->val;
+  u64 k[] = {bin_hash, host_hash, (u64)image, thunks};
+  return hashbytes((u8 *)k, sizeof k);
+}
+
+static void put(vec_char_t *v, void const *p, u64 sz) {
+  vec_pusharr(v, (char const *)p, sz);
+}
+
+static void *get(u8 **cur, void *dst, u64 sz) {
+  memcpy(dst, *cur, sz);
+  *cur += sz;
+  return dst;
+}
+
+static void putstr(vec_char_t *v, char const *s) {
+  u32 len = strlen(s);
+  put(v, &len, sizeof len);
+  put(v, s, len + 1);
+}
+
+static char const *getstr(u8 **cur) {
+  u32 len;
+  get(cur, &len, sizeof len);
+  char const *ret = (char *)*cur;
+  *cur += len + 1;
+  return ret;
+}
+
+static void patch(u8 *ptr, u8 etype, u64 i) {
+#define REL(T)                           \
+  {                                      \
+    u64 off = (u8 *)i - ptr - sizeof(T); \
+    memcpy(ptr, &off, sizeof(T));        \
+  }
+#define IMM(T) \
+  { memcpy(ptr, &i, sizeof(T)); }
+  switch (etype) {
+  case IET_REL_I8:
+    REL(i8);
+    break;
+  case IET_REL_I16:
+    REL(i16);
+    break;
+  case IET_REL_I32:
+    REL(i32);
+    break;
+  case IET_REL_I64:
+    REL(i64);
+    break;
+  case IET_IMM_U8:
+    IMM(u8);
+    break;
+  case IET_IMM_U16:
+    IMM(u16);
+    break;
+  case IET_IMM_U32:
+    IMM(u32);
+    break;
+  case IET_IMM_I64:
+    IMM(i64);
+    break;
+  }
+#undef REL
+#undef IMM
+}
+
+static void cachepath(char *buf, u64 bufsz, char const *name) {
+  snprintf(buf, bufsz, "%s.CACHE", name);
+}
+
+static bool take(u8 **cur, u8 *end, u64 sz) {
+  if ((u64)(end - *cur) < sz)
+    return false;
+  *cur += sz;
+  return true;
+}
+
+static char const *takestr(u8 **cur, u8 *end) {
+  u32 len;
+  u8 *p = *cur;
+  if (!take(cur, end, sizeof len))
+    return NULL;
+  memcpy(&len, p, sizeof len);
+  char const *ret = (char *)*cur;
+  return take(cur, end, len + 1ul) && !ret[len] ? ret : NULL;
+}
+
+/* the header describes the file it came from */
+static bool layoutok(CCacheHdr const *hdr, u64 filesz) {
+  return filesz >= CACHE_ALIGN && hdr->image_sz >= sizeof(CBinFile)
+      && hdr->image_sz <= filesz - CACHE_ALIGN
+      && hdr->meta_off >= CACHE_ALIGN + hdr->image_sz
+      && hdr->meta_off <= filesz && hdr->meta_sz <= filesz - hdr->meta_off;
+}
+
+/* a dry run of LoadCache's walk over meta, nothing's applied unless it all
+ * stays inside meta and the image */
+static bool metaok(CCacheHdr const *hdr, u8 *meta) {
+  u8 *cur = meta, *p, *end = meta + hdr->meta_sz;
+  u64 datasz = hdr->image_sz - sizeof(CBinFile), off;
+  for (u64 n = 0; n < hdr->nmains; n++) {
+    p = cur;
+    if (!take(&cur, end, sizeof off))
+      return false;
+    memcpy(&off, p, sizeof off);
+    if (off >= hdr->image_sz)
+      return false;
+  }
+  for (u64 n = 0; n < hdr->nsyms; n++)
+    if (!take(&cur, end, sizeof(u32) + 2 * sizeof(u64))
+        || !takestr(&cur, end))
+      return false;
+  for (u64 n = 0; n < hdr->nfixups; n++) {
+    u32 cnt, site[2];
+    char const *name;
+    if (!take(&cur, end, sizeof(u64)))
+      return false;
+    p = cur;
+    if (!take(&cur, end, sizeof cnt))
+      return false;
+    memcpy(&cnt, p, sizeof cnt);
+    if (!(name = takestr(&cur, end)) || !SymFind(name))
+      return false;
+    while (cnt--) {
+      p = cur;
+      if (!take(&cur, end, sizeof site))
+        return false;
+      memcpy(site, p, sizeof site);
+      /* IET_REL_I8...IET_IMM_I64 are 1,1,2,2,4,4,8,8 bytes */
+      if (site[1] < IET_REL_I8 || site[1] > IET_IMM_I64
+          || site[0] + (1ul << (site[1] - IET_REL_I8) / 2) > datasz)
+        return false;
+    }
+  }
+  return cur == end;
+}
+
+/* only for a racy mtime, q.v. Relocated image cache */
+static bool binhashok(char const *name, u64 sz, u64 bin_hash) {
+  u8 cleanup(_dtor) *bin = malloc(sz);
+  return bin && readfile(name, bin, sz) && hashbytes(bin, sz) == bin_hash;
+}
+
+static bool LoadCache(char const *path, char const *name, CFStat const *st,
+                      u64 host_hash, u64 *bin_hash, vec_void_t *mains,
+                      u8 **_image) {
+  CCacheHdr hdr;
+  CFStat cst;
+  int fd = openfd(path, false);
+  if (fd == -1)
+    return false;
+  u8 cleanup(_dtor) *meta = NULL;
+  bool ok = sizeof hdr == readfd(fd, (u8 *)&hdr, sizeof hdr)
+         && !memcmp(hdr.magic, CACHE_MAGIC, 8)
+         && hdr.version == CACHE_VERSION && hdr.host_hash == host_hash
+         && hdr.image_sz == (u64)st->size && hdr.bin_mtime == st->mtime
+         && statfd(fd, &cst) && layoutok(&hdr, cst.size)
+         && seekfd(fd, hdr.meta_off) && (meta = malloc(hdr.meta_sz ?: 1))
+         && (i64)hdr.meta_sz == readfd(fd, meta, hdr.meta_sz);
+  closefd(fd);
+  if (!ok || !metaok(&hdr, meta))
+    return false;
+  if (hdr.bin_mtime >= hdr.saved_at
+      && !binhashok(name, hdr.image_sz, hdr.bin_hash))
+    return false;
+  *bin_hash = hdr.bin_hash;
+  u8 *image = mapfile(path, CACHE_ALIGN, hdr.image_sz, (void *)hdr.image_base),
+     *cur = meta;
+  if (!image)
+    return false;
+  *_image = image;
+  vec_init(mains);
+  for (u64 n = 0; n < hdr.nmains; n++) {
+    u64 off;
+    get(&cur, &off, sizeof off);
+    vec_push(mains, image + off);
+  }
+  u8 *symcur = cur;
+  /* skip to the fixups, they have to use the host's values
+   * in case the image exported something with the same name */
+  for (u64 n = 0; n < hdr.nsyms; n++) {
+    cur += sizeof(u32) + 2 * sizeof(u64);
+    getstr(&cur);
+  }
+  for (u64 n = 0; n < hdr.nfixups; n++) {
+    u32 cnt, site[2];
+    u64 val;
+    get(&cur, &val, sizeof val);
+    get(&cur, &cnt, sizeof cnt);
+    CSymbol *sym = SymFind(getstr(&cur));
+    /* thunks are normally at the same place so this is a no-op */
+    if (verylikely(sym->val == (u8 *)val)) {
+      cur += cnt * sizeof site;
+      continue;
+    }
+    while (cnt--) {
+      get(&cur, site, sizeof site);
+      patch(((CBinFile *)image)->data + site[0], site[1], (u64)sym->val);
+    }
+  }
+  cur = symcur;
+  for (u64 n = 0; n < hdr.nsyms; n++) {
+    CSymbol sym = {0};
+    get(&cur, &sym.type, sizeof sym.type);
+    get(&cur, &sym.module_base, sizeof sym.module_base);
+    get(&cur, &sym.module_header_entry, sizeof sym.module_header_entry);
+    SymSet(getstr(&cur), sym);
+  }
+  return true;
+}
+
+static void SaveCache(char const *path, u8 *image, u64 sz, u64 bin_hash,
+                      u64 bin_mtime, u64 host_hash, vec_void_t *mains) {
+  vec_char_t cleanup(_dtor) meta = {0};
+  CCacheHdr hdr = {
+      .magic = CACHE_MAGIC,
+      .version = CACHE_VERSION,
+      .bin_hash = bin_hash,
+      .host_hash = host_hash,
+      .bin_mtime = bin_mtime,
+      .saved_at = time(NULL),
+      .image_base = (u64)image,
+      .image_sz = sz,
+      .meta_off = CACHE_ALIGN + ALIGNNUM(sz, CACHE_ALIGN),
+      .nmains = mains->length,
+  };
+  void *p;
+  int iter;
+  vec_foreach(mains, p, iter) {
+    u64 off = (u8 *)p - image;
+    put(&meta, &off, sizeof off);
+  }
+  u64 it = 0;
+  char const *k;
+  CSymbol *sym;
+  while ((k = SymNext(&it, &sym))) {
+    if (sym->type == HTT_FUN) /* host */
+      continue;
+    put(&meta, &sym->type, sizeof sym->type);
+    put(&meta, &sym->module_base, sizeof sym->module_base);
+    put(&meta, &sym->module_header_entry, sizeof sym->module_header_entry);
+    putstr(&meta, k);
+    hdr.nsyms++;
+  }
+  /* runs of sites sharing one symbol, LoadOneImport emits them in order */
+  for (int i = 0, j; i < hostfixups.length; i = j) {
+    CHostFixup *f = hostfixups.data + i;
+    for (j = i; j < hostfixups.length && hostfixups.data[j].name == f->name;)
+      j++;
+    u32 cnt = j - i;
+    put(&meta, &f->val, sizeof f->val);
+    put(&meta, &cnt, sizeof cnt);
+    putstr(&meta, f->name);
+    for (; f != hostfixups.data + j; f++)
+      put(&meta, (u32[]){f->off, f->etype}, 2 * sizeof(u32));
+    hdr.nfixups++;
+  }
+  hdr.meta_sz = meta.length;
+  char tmp[0x240];
+  int fd = openscratch(tmp, sizeof tmp, path);
+  if (fd == -1)
+    return;
+  u8 pad[0x1000] = {0};
+  bool ok = sizeof hdr == writefd(fd, (u8 *)&hdr, sizeof hdr)
+         && seekfd(fd, CACHE_ALIGN)
+         && (i64)sz == writefd(fd, image, sz)
+         && seekfd(fd, hdr.meta_off)
+         && meta.length == writefd(fd, (u8 *)meta.data, meta.length)
+         /* mapping the tail of the image shouldn't run past EOF */
+         && sizeof pad == writefd(fd, pad, sizeof pad);
+  commitfile(fd, tmp, path, ok);
+}
+
+vec_void_t LoadHCRT(char const *name, bool cache) {
+  CFStat st;
+  if (!statpath(name, &st) || st.dir) {
     flushprint(stderr, "Can't find file / filesystem error\n");
     terminate(1);
   }
-  int fd = openfd(name, false);
-  if (fd == -1) {
+  char path[0x220];
+  cachepath(path, sizeof path, name);
+  u64 bin_hash, host_hash = cache ? hosthash() : 0;
+  vec_void_t ret;
+  u8 *image;
+  if (cache
+      && LoadCache(path, name, &st, host_hash, &bin_hash, &ret, &image)) {
+    HdrCacheInit(name, hdrkey(bin_hash, host_hash, image));
+    SymIdxSync();
+    return ret;
+  }
+  i64 sz = st.size;
+  u8 cleanup(_dtor) *bin = malloc(sz);
+  if (!readfile(name, bin, sz)) {
     flushprint(stderr, "Can't open \"%s\"\n", name);
     terminate(1);
   }
-  void *bfh_addr;
-  readfd(fd, bfh_addr = NewVirtualChunk(sz, true), sz);
-  closefd(fd);
+  bin_hash = cache ? hashbytes(bin, sz) : 0;
+  void *bfh_addr = NewVirtualChunkAt((void *)HCRT_BASE, sz, true)
+                ?: NewVirtualChunk(sz, true);
+  memcpy(bfh_addr, bin, sz);
   CBinFile *bfh = bfh_addr;
   if (memcmp(bfh->bin_signature, "TOSB" /*BIN_SIGNATURE_VAL*/, 4)) {
     flushprint(stderr, "invalid file '%s'\n", name);
     terminate(1);
   }
   u8 *patchtable = bfh_addr + bfh->patch_table_offset, *code = bfh->data;
+  recfixups = cache;
   LoadPass1(patchtable, code);
-  return LoadPass2(patchtable, code);
+  recfixups = false;
+  ret = LoadPass2(patchtable, code);
+  if (cache) {
+    SaveCache(path, bfh_addr, sz, bin_hash, st.mtime, host_hash, &ret);
+    HdrCacheInit(name, hdrkey(bin_hash, host_hash, bfh_addr));
+  }
+  vec_deinit(&hostfixups);
+  /* crash dumps symbolize from signal handlers, index everything now */
+  SymIdxSync();
+  return ret;
 }
 
 static void LoadOneImport(u8 **_src, u8 *module_base) {
   u8 *src = *_src, *ptr = NULL;
   u64 i = 0;
-  bool first = true;
-  u8 etype;
+  bool first = true, host = false;
+  u8 etype, *name = NULL;
   CSymbol *sym;
   while ((etype = *src++)) {
     ptr = module_base + *(u32 *)src;
@@ -77,65 +451,43 @@ static void LoadOneImport(u8 **_src, u8 *module_base) {
       return;
     } else {
       first = false;
-      if ((sym = map_get(&symtab, (char *)st_ptr))) {
+      name = st_ptr;
+      if ((sym = SymFind((char *)st_ptr))) {
         if (sym->type != HTT_IMPORT_SYS_SYM)
           i = (u64)sym->val;
+        host = sym->type == HTT_FUN;
       } else {
         flushprint(stderr, "Unresolved reference %s\n", (char *)st_ptr);
-        map_set(&symtab, (char *)st_ptr,
-                (CSymbol){
-                    .type = HTT_IMPORT_SYS_SYM,
-                    .module_base = module_base,
-                    .module_header_entry = st_ptr - 5,
-                });
+        SymSet((char *)st_ptr, (CSymbol){
+                                   .type = HTT_IMPORT_SYS_SYM,
+                                   .module_base = module_base,
+                                   .module_header_entry = st_ptr - 5,
+                               });
       }
     }
-#define REL(T)                           \
-  {                                      \
-    u64 off = (u8 *)i - ptr - sizeof(T); \
-    memcpy(ptr, &off, sizeof(T));        \
-  }
-#define IMM(T) \
-  { memcpy(ptr, &i, sizeof(T)); }
   iet:
-    switch (etype) {
-    case IET_REL_I8:
-      REL(i8);
-      break;
-    case IET_REL_I16:
-      REL(i16);
-      break;
-    case IET_REL_I32:
-      REL(i32);
-      break;
-    case IET_REL_I64:
-      REL(i64);
-      break;
-    case IET_IMM_U8:
-      IMM(u8);
-      break;
-    case IET_IMM_U16:
-      IMM(u16);
-      break;
-    case IET_IMM_U32:
-      IMM(u32);
-      break;
-    case IET_IMM_I64:
-      IMM(i64);
-      break;
-    }
+    if (host && recfixups)
+      vec_push(&hostfixups, ((CHostFixup){
+                                .name = (char *)name,
+                                .val = i,
+                                .off = ptr - module_base,
+                                .etype = etype,
+                            }));
+    patch(ptr, etype, i);
   }
   *_src = src - 1;
 }
 
 static void SysSymImportsResolve(u8 *st_ptr) {
-  CSymbol *sym = map_get(&symtab, (char *)st_ptr);
+  CSymbol *sym = SymFind((char *)st_ptr);
   if (!sym)
     return;
   if (sym->type != HTT_IMPORT_SYS_SYM)
     return;
-  LoadOneImport(&sym->module_header_entry, sym->module_base);
-  sym->type = HTT_INVALID;
+  /* LoadOneImport may SymSet and move sym */
+  u8 *entry = sym->module_header_entry;
+  LoadOneImport(&entry, sym->module_base);
+  SymFind((char *)st_ptr)->type = HTT_INVALID;
 }
 
 static void LoadPass1(u8 *src, u8 *module_base) {
@@ -150,11 +502,10 @@ static void LoadPass1(u8 *src, u8 *module_base) {
     case IET_REL32_EXPORT ... IET_IMM64_EXPORT:
       if (etype != IET_IMM32_EXPORT && etype != IET_IMM64_EXPORT)
         i += (u64)module_base;
-      map_set(&symtab, (char *)st_ptr,
-              (CSymbol){
-                  .type = HTT_EXPORT_SYS_SYM,
-                  .val = (void *)i,
-              });
+      SymSet((char *)st_ptr, (CSymbol){
+                                 .type = HTT_EXPORT_SYS_SYM,
+                                 .val = (void *)i,
+                             });
       SysSymImportsResolve(st_ptr);
       break;
     case IET_REL_I0 ... IET_IMM_I64:
@@ -198,3 +549,7 @@ static vec_void_t LoadPass2(u8 *src, u8 *module_base) {
   }
   return ret;
 }
+
+/* CITATIONS:
+ * [1]: https://git-scm.com/docs/racy-git
+ */
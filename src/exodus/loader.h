@@ -1,24 +1,21 @@
 #pragma once
 
-#include <map/map.h>
+#include <stdbool.h>
+#include <stdint.h>
+
 #include <vec/vec.h>
 
+#include <exodus/symtab.h>
 #include <exodus/types.h>
 
-typedef struct {
-  u32 type;
-  union {
-    u8 *val; // CHashExport
-    struct {
-      u8 *module_base, *module_header_entry; // CHashImport
-    };
-  };
-} CSymbol;
-
-typedef map_t(CSymbol) map_sym_t;
-extern map_sym_t symtab;
+/* Fixed low addresses for the FFI thunks and the kernel so a relocated image
+ * stays valid across runs, q.v. "Relocated image cache" in loader.c */
+#define FFI_THUNK_BASE UINT64_C(0x10000000)
+#define HCRT_BASE      UINT64_C(0x10100000)
+/* q.v. "Boot cache" in hdrcache.c */
+#define HDRCACHE_BASE  UINT64_C(0x30000000)
 
-vec_void_t LoadHCRT(char const *s);
+vec_void_t LoadHCRT(char const *s, bool cache);
 
 /* clang-format off */
 /* Copied from TempleOS */
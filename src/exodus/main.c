@@ -12,6 +12,7 @@
 #include <argtable3.h>
 #include <isocline.h>
 
+#include <exodus/alloc.h>
 #include <exodus/dbg.h>
 #include <exodus/ffi.h>
 #include <exodus/loader.h>
@@ -28,8 +29,10 @@ __attribute__((constructor)) static void init(void) {
   strcpy(bin_path, "HCRT.BIN");
 }
 
-static struct arg_lit *help, *_60fps, *cli, *grab;
-static struct arg_file *clifiles, *drv, *hcrt;
+static struct arg_lit *help, *_60fps, *cli, *grab, *nocache, *headless, *png,
+    *hugepages;
+static struct arg_file *clifiles, *drv, *hcrt, *dumpdir;
+static struct arg_int *dumpevery;
 static struct arg_end *end;
 
 u64 IsCmdLine(void) {
@@ -56,15 +59,30 @@ int main(int argc, char **argv) {
       _60fps = arg_lit0("6", "60fps", "Run in 60 FPS"),
       cli = arg_lit0("c", "com", "Command line mode"),
       hcrt = arg_file0("f", "hcrtfile", NULL, "Specify HolyC runtime"),
+      nocache = arg_lit0(NULL, "nocache",
+                         "Don't use/create the relocated HolyC runtime and "
+                         "compiled header caches"),
       drv = arg_file0("t", "root", NULL, "Specify boot folder"),
+      headless = arg_lit0(NULL, "headless",
+                          "Render to an offscreen framebuffer, no window"),
+      dumpdir = arg_file0(NULL, "dump-frames", "<dir>",
+                          "Dump frames to <dir>, used with --headless"),
+      dumpevery = arg_int0(NULL, "dump-every", "<n>",
+                           "Dump every nth frame (default: 30)"),
+      png = arg_lit0(NULL, "png", "Dump frames as PNG instead of raw BGRA"),
+      hugepages = arg_lit0(NULL, "hugepages",
+                           "Back big heap and code chunks with 2MiB pages"),
       clifiles = arg_filen(NULL, NULL, "<files>", 0, 100,
                            ".HC files that run on startup, used with -c"),
       end = arg_end(10),
   };
   int errs = arg_parse(argc, argv, argtable);
-  if (help->count || errs > 0) {
+  bool badevery = !errs && dumpevery->count && dumpevery->ival[0] < 1;
+  if (help->count || errs > 0 || badevery) {
     if (errs)
       arg_print_errors(stderr, end, argv[0]);
+    if (badevery)
+      flushprint(stderr, "%s: --dump-every must be at least 1\n", argv[0]);
     flushprint(stderr, "Usage: %s", argv[0]);
     arg_print_syntaxv(stderr, argtable, "\n");
     arg_print_glossary_gnu(stderr, argtable);
@@ -109,8 +127,13 @@ int main(int argc, char **argv) {
                bin_path);
     return 1;
   }
+  if (headless->count)
+    SetHeadless(dumpdir->count ? dumpdir->filename[0] : NULL,
+                dumpevery->count ? dumpevery->ival[0] : 30, png->count);
+  if (hugepages->count)
+    HugePagesEnable();
   BootstrapLoader();
-  CreateCore(LoadHCRT(bin_path));
+  CreateCore(LoadHCRT(bin_path, !nocache->count));
   EventLoop();
   return 0;
 }
@@ -4,10 +4,12 @@
 // Refer to the LICENSE file for license info.
 // Any citation links are provided at the end of the file.
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <exodus/misc.h>
+#include <exodus/shims.h>
 #include <exodus/types.h>
 
 /* ctype.h the TempleOS way
@@ -81,6 +83,25 @@ void _dtor(void *_p) {
   free(*p);
 }
 
+/* The caches are written while other instances might be mapping them, so
+ * they're built under a unique name and renamed over the old file in one go.
+ * Readers see either the old file or the whole new one, never half of it. */
+int openscratch(char *tmp, u64 tmpsz, char const *path) {
+  snprintf(tmp, tmpsz, "%s.%jx", path, (u64)getticksus() ^ (u64)tmp);
+  return openfd(tmp, true);
+}
+
+bool commitfile(int fd, char const *tmp, char const *path, bool ok) {
+  closefd(fd);
+  if (ok && rename(tmp, path)) {
+    remove(path); /* NT won't rename over an existing file */
+    ok = !rename(tmp, path);
+  }
+  if (!ok)
+    remove(tmp);
+  return ok;
+}
+
 /* CITATIONS:
  * [1]
  * https://opensource.apple.com/source/Libc/Libc-825.26/string/FreeBSD/memmem.c.auto.html
@@ -112,6 +112,12 @@ void *memmem2(void *haystk, u64 haystklen, void *needle, u64 needlelen);
 void *mempcpy2(void *restrict dst, void const *src, u64 sz);
 void *memdup(void *alloc(u64 _sz), void const *src, u64 sz);
 
+/* FILES */
+/* scratch file next to path for commitfile(), its name goes in tmp */
+int openscratch(char *tmp, u64 tmpsz, char const *path);
+/* closes fd, moves tmp over path if ok, removes tmp otherwise */
+bool commitfile(int fd, char const *tmp, char const *path, bool ok);
+
 // CLI I/O might interfere with output, happens frequently with NT
 #define flushprint(f, a...) \
   do {                      \
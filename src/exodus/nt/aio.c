@@ -0,0 +1,23 @@
+// vi: set et ft=c ts=2 sts=2 sw=2 fenc=utf-8 :vi
+//
+// Copyright 2024 1fishe2fishe
+// Refer to the LICENSE file for license info.
+// Any citation links are provided at the end of the file.
+#include <errno.h>
+#include <stdbool.h>
+
+#include <exodus/aio.h>
+#include <exodus/misc.h>
+#include <exodus/shims.h>
+#include <exodus/types.h>
+
+/* No overlapped I/O here yet, the request is done before we return so
+ * AioRW never parks (q.v. posix/aio.c) */
+void AioSubmit(CAioReq *r, int fd, u8 *buf, u64 len, i64 off, bool wr,
+               argign i64 *wake) {
+  i64 res = -1;
+  if (seekfd(fd, off))
+    res = wr ? writefd(fd, buf, len) : readfd(fd, buf, len);
+  r->res = res == -1 ? -errno : res;
+  r->done = r->fin = 1;
+}
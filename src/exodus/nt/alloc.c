@@ -80,10 +80,32 @@ ret:
   return ret;
 }
 
+void *NewVirtualChunkAt(void *at, u64 sz, bool exec) {
+  /* VirtualAlloc fails if the range is taken, exactly what we want */
+  return VirtualAlloc(at, sz, MEM_RESERVE | MEM_COMMIT,
+                      exec ? PAGE_EXECUTE_READWRITE : PAGE_READWRITE);
+}
+
 void FreeVirtualChunk(void *ptr, argign u64 sz) {
   VirtualFree(ptr, 0, MEM_RELEASE);
 }
 
+void FreeVirtualChunkAt(void *ptr, argign u64 sz) {
+  VirtualFree(ptr, 0, MEM_RELEASE);
+}
+
+/* Large pages need SeLockMemoryPrivilege, which nobody running this has */
+u64 VirtualChunkSz(u64 sz) {
+  return sz;
+}
+
+void HugePagesEnable(void) {
+}
+
+void HugePagesStats(u64 *out) {
+  out[0] = out[1] = out[2] = out[3] = 0;
+}
+
 /* CITATIONS:
  * [1] https://stackoverflow.com/a/54732489 (https://archive.md/ugIUC)
  * [2]
@@ -56,10 +56,10 @@ static LONG WINAPI VEHandler(EXCEPTION_POINTERS *info) {
       REG(EFlags),
   };
   BackTrace(REG(Rbp), REG(Rip));
-  static CSymbol *sym;
-  if (!sym)
-    sym = map_get(&symtab, "DebuggerLandWin");
-  fficall(sym->val, sig, regs);
+  static void *fp;
+  if (!fp)
+    fp = SymFind("DebuggerLandWin")->val;
+  fficall(fp, sig, regs);
   return E(CONTINUE_EXECUTION);
 }
 
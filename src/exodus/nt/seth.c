@@ -27,6 +27,7 @@
 #include <exodus/main.h>
 #include <exodus/misc.h>
 #include <exodus/nt/ntdll.h>
+#include <exodus/profiler.h>
 #include <exodus/seth.h>
 #include <exodus/shims.h>
 #include <exodus/vfs.h>
@@ -41,6 +42,7 @@ typedef struct {
   i32 sleeping, core_num;
   u8 *profiler_int;
   u64 profiler_freq, next_prof_int;
+  u64 next_sample;
   vec_void_t funcptrs;
 } CCore;
 
@@ -49,6 +51,8 @@ static _Thread_local CCore *self;
 static u64 nproc;
 static u64 pf_prof_active;
 static MMRESULT pf_prof_timer;
+/* host-side sampler interval in ms (q.v. profiler.c), 0 if off */
+static u64 pf_sample_freq;
 static bool iswine;
 
 static DWORD __stdcall Seth(void *arg) {
@@ -70,16 +74,16 @@ u64 CoreNum(void) {
 /* TempleOS does not yield contexts automatically
  * (everything is a coroutine) so we need a brute force solution */
 void InterruptCore(u64 core) {
-  static CSymbol *sym;
+  static void *fp;
   CCore *c = cores + core;
   CONTEXT ctx = {.ContextFlags = CONTEXT_FULL};
   SuspendThread(c->thread);
   GetThreadContext(c->thread, &ctx);
-  if (veryunlikely(!sym))
-    sym = map_get(&symtab, "Yield");
+  if (veryunlikely(!fp))
+    fp = SymFind("Yield")->val;
   ctx.Rsp = (u64)c->altstack + SIGSTKSZ;
   *(u64 *)(ctx.Rsp -= 8) = ctx.Rip; /* return addr */
-  ctx.Rip = (u64)sym->val;
+  ctx.Rip = (u64)fp;
   SetThreadContext(c->thread, &ctx);
   ResumeThread(c->thread);
 }
@@ -104,19 +108,39 @@ static void apcnop(u64 arg) {
 
 void WakeCoreUp(u64 core) {
   CCore *c = cores + core;
-  if (!LBtr(&c->sleeping, 0))
+  /* 2: woken before it got to SleepMillis, q.v. posix/seth.c */
+  if (__atomic_exchange_n(&c->sleeping, 2, __ATOMIC_ACQ_REL) != 1)
     return;
   // q.v. SleepMillis
   // APCs execute immediately if thread is alertable
   QueueUserAPC(apcnop, c->thread, 0);
 }
 
+void WakeIdleCore(void) {
+  for (u64 i = 0; i < nproc; i++) {
+    CCore *c = cores + i;
+    if (c != self && __atomic_load_n(&c->sleeping, __ATOMIC_RELAXED) == 1) {
+      WakeCoreUp(i);
+      return;
+    }
+  }
+}
+
+static void JiffiesSync(void);
+
 void SleepMillis(u64 ms) {
-  LBts(&self->sleeping, 0);
+  i32 awake = 0;
+  if (!__atomic_compare_exchange_n(&self->sleeping, &awake, 1, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n(&self->sleeping, 0, __ATOMIC_RELEASE);
+    JiffiesSync();
+    return;
+  }
   // 10000 = 1ms, negative for relative time (q.v. ntdll.h)
   LARGE_INTEGER delay = {.QuadPart = -ms * 10000};
   NtDelayExecution(TRUE /* alertable so APCs can interrupt */, &delay);
-  LBtr(&self->sleeping, 0);
+  __atomic_store_n(&self->sleeping, 0, __ATOMIC_RELEASE);
+  JiffiesSync();
 }
 
 static u32 inc;
@@ -133,22 +157,60 @@ static u64 elapsedms(void) {
   return getticksus() / 1e3;
 }
 
+/* cnts.jiffies/cnts.timer are derived from the monotonic clock instead of
+ * summing up timer callbacks, q.v. Tickless IRQ 0 in posix/seth.c.
+ * timeSetEvent() can't be parked cheaply so it keeps ticking here */
+#define SYS_TIMER_FREQ (18333 * 65536 / 1000) // KernelA.HH
+
+static struct {
+  /* &cnts.jiffies, cnts.timer follows */
+  i64 *cnts;
+  i64 jiffies0, timer0, us0;
+} clk;
+
+static void storemax(i64 *p, i64 v) {
+  i64 old = __atomic_load_n(p, __ATOMIC_RELAXED);
+  while (old < v && !__atomic_compare_exchange_n(p, &old, v, true,
+                                                 __ATOMIC_RELAXED,
+                                                 __ATOMIC_RELAXED))
+    ;
+}
+
+static void JiffiesSync(void) {
+  if (veryunlikely(!clk.cnts))
+    return;
+  i64 us = getticksus() - clk.us0;
+  storemax(clk.cnts, clk.jiffies0 + us / 1000);
+  storemax(clk.cnts + 1, clk.timer0 + us / 1000000 * SYS_TIMER_FREQ
+                             + us % 1000000 * SYS_TIMER_FREQ / 1000000);
+}
+
+u64 SysTimerRead(void) {
+  JiffiesSync();
+  return clk.cnts ? __atomic_load_n(clk.cnts + 1, __ATOMIC_RELAXED) : 0;
+}
+
 static void irq0(u32 id, u32 msg, u64 userptr, u64 dw1, u64 dw2) {
   (void)id;
   (void)msg;
   (void)userptr;
   (void)dw1;
   (void)dw2;
-  static void *fp;
-  if (veryunlikely(!fp))
-    fp = map_get(&symtab, "IntCore0TimerHndlr")->val;
-  fficall(fp, inc);
+  JiffiesSync();
+}
+
+void WakeAtJiffy(argign i64 jiffy) {
+  /* irq0 syncs every tick anyway */
 }
 
 void InitIRQ0(void) {
   static bool init;
   if (init)
     return;
+  clk.cnts = (i64 *)SymFind("cnts")->val;
+  clk.jiffies0 = clk.cnts[0];
+  clk.timer0 = clk.cnts[1];
+  clk.us0 = getticksus();
   timeSetEvent(inc, inc, irq0, 0, TIME_PERIODIC);
   init = true;
 }
@@ -168,14 +230,25 @@ static void profcb(u32 id, u32 msg, u64 userptr, u64 dw1, u64 dw2) {
   (void)dw1;
   (void)dw2;
   for (u64 i = 0; i < nproc; ++i) {
-    if (!Bt(&pf_prof_active, i))
-      continue;
     CCore *c = cores + i;
-    if (elapsedms() < c->next_prof_int || !c->profiler_int)
+    u64 now = elapsedms();
+    bool sample = pf_sample_freq && now >= c->next_sample,
+         intr = Bt(&pf_prof_active, i) && c->profiler_int &&
+                now >= c->next_prof_int;
+    if (!sample && !intr)
       continue;
     CONTEXT ctx = {.ContextFlags = CONTEXT_FULL};
     SuspendThread(c->thread);
     GetThreadContext(c->thread, &ctx);
+    /* this timer thread is the only producer for every ring,
+     * the stack can be walked safely while the core is suspended */
+    if (sample) {
+      ProfSample(i, (u8 *)ctx.Rip, (u8 *)ctx.Rbp);
+      c->next_sample = pf_sample_freq + now;
+    }
+    if (!intr)
+      goto rel;
+    c->next_prof_int = c->profiler_freq + now;
     if (ctx.Rip > INT32_MAX) // crude check for HolyC
       goto rel;
     c->ctx = ctx;
@@ -185,7 +258,23 @@ static void profcb(u32 id, u32 msg, u64 userptr, u64 dw1, u64 dw2) {
     SetThreadContext(c->thread, &ctx);
   rel:
     ResumeThread(c->thread);
-    c->next_prof_int = c->profiler_freq + elapsedms();
+  }
+}
+
+/* one multimedia timer drives both MPSetProfilerInt and MPSetSampler */
+static void proftimer(void) {
+  if ((pf_prof_active || pf_sample_freq) == !!pf_prof_timer)
+    return;
+  if (pf_prof_timer) {
+    timeKillEvent(pf_prof_timer);
+    pf_prof_timer = 0;
+    return;
+  }
+  // TIME_KILL_SYNCHRONOUS only delays the return of timeKillEvent
+  pf_prof_timer = timeSetEvent(inc, inc, profcb, 0, TIME_PERIODIC);
+  if (!pf_prof_timer) {
+    flushprint(stderr, "timeSetEvent failed\n");
+    terminate(1);
   }
 }
 
@@ -195,17 +284,16 @@ void MPSetProfilerInt(void *fp, i64 idx, i64 freq) {
     c->profiler_freq = freq / 1e3;
     c->profiler_int = fp;
     c->next_prof_int = 0;
-    if (!pf_prof_timer) {
-      // TIME_KILL_SYNCHRONOUS only delays the return of timeKillEvent
-      pf_prof_timer = timeSetEvent(inc, inc, profcb, 0, TIME_PERIODIC);
-      if (!pf_prof_timer) {
-        flushprint(stderr, "timeSetEvent failed\n");
-        terminate(1);
-      }
-    }
     LBts(&pf_prof_active, idx);
-  } else if (LBtr(&pf_prof_active, idx)) {
-    timeKillEvent(pf_prof_timer);
-    pf_prof_timer = 0;
-  }
+  } else
+    LBtr(&pf_prof_active, idx);
+  proftimer();
+}
+
+void MPSetSampler(i64 freq) {
+  for (u64 i = 0; i < nproc; i++)
+    cores[i].next_sample = 0;
+  /* multimedia timers can't go below 1ms */
+  pf_sample_freq = freq > 0 ? Max(freq / 1000, 1) : 0;
+  proftimer();
 }
@@ -72,6 +72,34 @@ bool isdir(char const *path) {
   return PathIsDirectoryA(path);
 }
 
+static bool fromstat(struct _stati64 *s, CFStat *st) {
+  *st = (CFStat){
+      .size = s->st_size,
+      .mtime = s->st_mtime,
+      .exists = true,
+      .dir = s->st_mode & _S_IFDIR,
+  };
+  return true;
+}
+
+bool statpath(char const *path, CFStat *st) {
+  struct _stati64 s;
+  if (_stati64(path, &s)) {
+    *st = (CFStat){0};
+    return false;
+  }
+  return fromstat(&s, st);
+}
+
+bool statfd(int fd, CFStat *st) {
+  struct _stati64 s;
+  if (_fstati64(fd, &s)) {
+    *st = (CFStat){0};
+    return false;
+  }
+  return fromstat(&s, st);
+}
+
 /* emulated stack frame */
 typedef struct {
   HANDLE fh;
@@ -202,6 +230,35 @@ char **listdir(char const *path) {
   return memdup(HolyMAlloc, ls.data, sizeof(PSTR[ls.length]));
 }
 
+bool statdir(char const *path,
+             void cb(char const *name, CFStat const *st, void *user0),
+             void *user0) {
+  char buf[MAX_PATH];
+  WIN32_FIND_DATAA d;
+  snprintf(buf, sizeof buf, "%s\\*", path);
+  /* FindFirstFile already has everything, no stat per entry */
+  HANDLE h = FindFirstFileA(buf, &d);
+  if (veryunlikely(h == INVALID_HANDLE_VALUE))
+    return false;
+  do {
+    if (veryunlikely(strlen(d.cFileName) > 37))
+      continue;
+    /* 100ns ticks since 1601 -> unix seconds */
+    u64 t = (u64)d.ftLastWriteTime.dwHighDateTime << 32 |
+            d.ftLastWriteTime.dwLowDateTime;
+    cb(d.cFileName,
+       &(CFStat){
+           .size = (u64)d.nFileSizeHigh << 32 | d.nFileSizeLow,
+           .mtime = (t - 116444736000000000ull) / 10000000,
+           .exists = true,
+           .dir = d.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY,
+       },
+       user0);
+  } while (FindNextFileA(h, &d));
+  FindClose(h);
+  return true;
+}
+
 static void fsizecb(FileInfo *d, void *user0) {
   i64 *p = user0;
   if (verylikely(d->FileNameLength / sizeof(WCHAR) <= 37))
@@ -254,6 +311,36 @@ bool writefile(char const *path, u8 const *data, i64 sz) {
   return sz == _write(fd, data, sz);
 }
 
+void *mapfile(char const *path, u64 off, u64 sz, void *addr) {
+  /* can't use _open, the handle needs GENERIC_EXECUTE */
+  HANDLE fh = CreateFileA(path, GENERIC_READ | GENERIC_EXECUTE,
+                          FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (veryunlikely(fh == INVALID_HANDLE_VALUE))
+    return NULL;
+  HANDLE mh = CreateFileMappingA(fh, NULL, PAGE_EXECUTE_WRITECOPY, 0, 0, NULL);
+  CloseHandle(fh);
+  if (veryunlikely(!mh))
+    return NULL;
+  /* the view keeps the section alive */
+  void *ret = MapViewOfFileEx(mh, FILE_MAP_COPY | FILE_MAP_EXECUTE, off >> 32,
+                              off & 0xFFFFFFFF, sz, addr);
+  CloseHandle(mh);
+  return ret;
+}
+
+/* no file views on Windows yet, VFsFMap() callers copy instead */
+void *mapview(argign char const *path, argign u64 *lenp) {
+  return NULL;
+}
+
+bool unmapview(argign void *p) {
+  return false;
+}
+
+void detachviews(argign char const *path) {
+}
+
 bool seekfd(int fd, i64 off) {
   return -1 != _lseeki64(fd, off, SEEK_SET);
 }
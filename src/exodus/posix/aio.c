@@ -0,0 +1,273 @@
+// vi: set et ft=c ts=2 sts=2 sw=2 fenc=utf-8 :vi
+//
+// Copyright 2024 1fishe2fishe
+// Refer to the LICENSE file for license info.
+// Any citation links are provided at the end of the file.
+#ifdef __linux__
+  #include <linux/io_uring.h>
+  #include <sys/mman.h>
+  #include <sys/syscall.h>
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <exodus/aio.h>
+#include <exodus/misc.h>
+#include <exodus/seth.h>
+#include <exodus/types.h>
+
+/*
+ * Async I/O
+ *
+ * FBlkRead() and VirtFileRead() used to read(2) right on the Seth core's
+ * thread, so every task on that core stalled behind one big file. Now the
+ * issuing task parks with wake_jiffy=AIO_PARKED (q.v. AioRW) and the core
+ * goes on scheduling the rest. When the I/O is done we fill in its
+ * CAioReq, knock wake_jiffy back to 0 if it is still parked on us and
+ * kick the core out of SleepMillis().
+ *
+ * io_uring does the work if the kernel gives us a ring, with one reaper
+ * thread blocked on the completion queue. READV/WRITEV are used because
+ * they are there since the first io_uring kernel[1]. Without a ring (old
+ * kernels, seccomp'd containers, FreeBSD), or when it is full, a few
+ * worker threads pread/pwrite requests off a FIFO.
+ */
+
+typedef struct CAio {
+  struct CAio *next;
+  CAioReq *req;
+  i64 *wake;
+  u64 core;
+  struct iovec iov;
+  i64 off;
+  int fd;
+  bool wr;
+} CAio;
+
+#define POOL_THRDS 4
+#define RING_ENTS  64
+
+static struct {
+  pthread_once_t once;
+  pthread_mutex_t mtx;
+  pthread_cond_t cv;
+  CAio *head, **tail;
+  /* a worker is up, else requests are done synchronously */
+  bool pool;
+#ifdef __linux__
+  int ring;
+  u32 *sqhead, *sqtail, *sqarr, sqmask;
+  u32 *cqhead, *cqtail, cqmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  /* kept under the SQ size so the CQ never overflows */
+  u32 inflight, ents;
+#endif
+} aio = {
+    .once = PTHREAD_ONCE_INIT,
+    .mtx = PTHREAD_MUTEX_INITIALIZER,
+    .cv = PTHREAD_COND_INITIALIZER,
+    .tail = &aio.head,
+#ifdef __linux__
+    .ring = -1,
+#endif
+};
+
+static void aiodone(CAio *a, i64 res) {
+  i64 parked = AIO_PARKED;
+  CAioReq *r = a->req;
+  u64 core = a->core;
+  r->res = res;
+  __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+  /* if the task already saw done it may have stopped parking, hence the
+   * cmpxchg. Neither *r nor the task go away before fin (q.v. TaskEnd) */
+  __atomic_compare_exchange_n(a->wake, &parked, 0, false, __ATOMIC_ACQ_REL,
+                              __ATOMIC_RELAXED);
+  free(a);
+  __atomic_store_n(&r->fin, 1, __ATOMIC_RELEASE);
+  WakeCoreUp(core);
+}
+
+static i64 aiosync(CAio *a) {
+  i64 r = a->wr ? pwrite(a->fd, a->iov.iov_base, a->iov.iov_len, a->off)
+                : pread(a->fd, a->iov.iov_base, a->iov.iov_len, a->off);
+  return r == -1 ? -errno : r;
+}
+
+static void *aioworker(argign void *arg) {
+  CAio *a;
+  while (true) {
+    pthread_mutex_lock(&aio.mtx);
+    while (!(a = aio.head))
+      pthread_cond_wait(&aio.cv, &aio.mtx);
+    if (!(aio.head = a->next))
+      aio.tail = &aio.head;
+    pthread_mutex_unlock(&aio.mtx);
+    aiodone(a, aiosync(a));
+  }
+  return NULL;
+}
+
+#ifdef __linux__
+static void *ringreaper(argign void *arg) {
+  while (true) {
+    /* EINTR is fine, we just look at the CQ again */
+    syscall(__NR_io_uring_enter, aio.ring, 0, 1, IORING_ENTER_GETEVENTS, NULL,
+            0);
+    u32 head = *aio.cqhead,
+        tail = __atomic_load_n(aio.cqtail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = aio.cqes + (head & aio.cqmask);
+      CAio *a = (CAio *)cqe->user_data;
+      i64 res = cqe->res;
+      __atomic_store_n(aio.cqhead, head + 1, __ATOMIC_RELEASE);
+      __atomic_fetch_sub(&aio.inflight, 1, __ATOMIC_RELEASE);
+      aiodone(a, res);
+    }
+  }
+  return NULL;
+}
+
+static bool ringinit(void) {
+  struct io_uring_params p = {0};
+  int fd = syscall(__NR_io_uring_setup, RING_ENTS, &p);
+  if (fd == -1)
+    return false;
+  u64 sqsz = p.sq_off.array + p.sq_entries * sizeof(u32),
+      cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single)
+    sqsz = cqsz = Max(sqsz, cqsz);
+  u8 *sq = mmap(NULL, sqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd, IORING_OFF_SQ_RING),
+     *cq = sq;
+  if (sq == MAP_FAILED)
+    goto fail;
+  if (!single &&
+      MAP_FAILED == (cq = mmap(NULL, cqsz, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, fd,
+                               IORING_OFF_CQ_RING)))
+    goto fail_sq;
+  void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                    IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    goto fail_cq;
+  aio.sqhead = (u32 *)(sq + p.sq_off.head);
+  aio.sqtail = (u32 *)(sq + p.sq_off.tail);
+  aio.sqarr = (u32 *)(sq + p.sq_off.array);
+  aio.sqmask = *(u32 *)(sq + p.sq_off.ring_mask);
+  aio.cqhead = (u32 *)(cq + p.cq_off.head);
+  aio.cqtail = (u32 *)(cq + p.cq_off.tail);
+  aio.cqmask = *(u32 *)(cq + p.cq_off.ring_mask);
+  aio.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  aio.sqes = sqes;
+  aio.ents = p.sq_entries;
+  aio.ring = fd;
+  pthread_t t;
+  if (!pthread_create(&t, NULL, ringreaper, NULL)) {
+    pthread_setname_np(t, "io_uring reaper");
+    return true;
+  }
+  aio.ring = -1;
+  munmap(sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+fail_cq:
+  if (!single)
+    munmap(cq, cqsz);
+fail_sq:
+  munmap(sq, sqsz);
+fail:
+  close(fd);
+  return false;
+}
+
+/* false if the ring is full or won't take it, let the pool have it then */
+static bool ringsubmit(CAio *a) {
+  bool ok = false;
+  pthread_mutex_lock(&aio.mtx);
+  if (__atomic_load_n(&aio.inflight, __ATOMIC_ACQUIRE) >= aio.ents)
+    goto ret;
+  /* only we write the SQ tail and the kernel eats entries as soon as
+   * io_uring_enter() returns, so the slot at tail is always free */
+  u32 tail = *aio.sqtail, idx = tail & aio.sqmask;
+  struct io_uring_sqe *sqe = aio.sqes + idx;
+  memset(sqe, 0, sizeof *sqe);
+  sqe->opcode = a->wr ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd = a->fd;
+  sqe->off = a->off;
+  sqe->addr = (u64)&a->iov;
+  sqe->len = 1;
+  sqe->user_data = (u64)a;
+  aio.sqarr[idx] = idx;
+  __atomic_fetch_add(&aio.inflight, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(aio.sqtail, tail + 1, __ATOMIC_RELEASE);
+  if (syscall(__NR_io_uring_enter, aio.ring, 1, 0, 0, NULL, 0) == 1)
+    ok = true;
+  else if (__atomic_load_n(aio.sqhead, __ATOMIC_ACQUIRE) == tail) {
+    /* EAGAIN/EBUSY, the kernel never looked at it so take it back */
+    __atomic_store_n(aio.sqtail, tail, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(&aio.inflight, 1, __ATOMIC_RELEASE);
+  } else /* consumed after all, the reaper will see it */
+    ok = true;
+ret:
+  pthread_mutex_unlock(&aio.mtx);
+  return ok;
+}
+#endif
+
+static void aioinit(void) {
+#ifdef __linux__
+  ringinit();
+#endif
+  for (int i = 0; i < POOL_THRDS; i++) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, aioworker, NULL))
+      continue;
+    pthread_setname_np(t, "Async I/O");
+    aio.pool = true;
+  }
+}
+
+void AioSubmit(CAioReq *r, int fd, u8 *buf, u64 len, i64 off, bool wr,
+               i64 *wake) {
+  pthread_once(&aio.once, aioinit);
+  CAio *a = malloc(sizeof *a);
+  if (veryunlikely(!a)) {
+    r->res = -ENOMEM;
+    __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->fin, 1, __ATOMIC_RELEASE);
+    return;
+  }
+  *a = (CAio){
+      .req = r,
+      .wake = wake,
+      .core = CoreNum(),
+      .iov = {buf, len},
+      .off = off,
+      .fd = fd,
+      .wr = wr,
+  };
+#ifdef __linux__
+  if (aio.ring != -1 && ringsubmit(a))
+    return;
+#endif
+  if (veryunlikely(!aio.pool)) {
+    aiodone(a, aiosync(a));
+    return;
+  }
+  pthread_mutex_lock(&aio.mtx);
+  *aio.tail = a;
+  aio.tail = &a->next;
+  pthread_cond_signal(&aio.cv);
+  pthread_mutex_unlock(&aio.mtx);
+}
+
+/* CITATIONS:
+ * [1] https://man7.org/linux/man-pages/man2/io_uring_enter.2.html
+ *     (IORING_OP_READV/IORING_OP_WRITEV, "Available since 5.1")
+ */
@@ -4,14 +4,18 @@
 // Refer to the LICENSE file for license info.
 // Any citation links are provided at the end of the file.
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
 #include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <exodus/alloc.h>
+#include <exodus/loader.h>
 #include <exodus/misc.h>
 #include <exodus/shims.h>
 #include <exodus/types.h>
@@ -19,31 +23,406 @@
 #define PROT                        PROT_READ | PROT_WRITE
 #define FLAGS                       MAP_PRIVATE | MAP_ANON
 #define MMAP(hint, sz, prot, flags) mmap((void *)(hint), sz, prot, flags, -1, 0)
+#ifdef MAP_FIXED_NOREPLACE
+  #define FIXED_EXCL MAP_FIXED_NOREPLACE
+#else // FreeBSD
+  #define FIXED_EXCL MAP_FIXED | MAP_EXCL
+#endif
+
+/* Low window
+ *
+ * HolyC code has to live below 2GB. Without MAP_32BIT (FreeBSD, or when its
+ * area is full) every executable chunk used to go through findregion(), which
+ * parses /proc/self/maps each time and races every other mmap in the process.
+ * Instead the free parts of [WIN_LO, WIN_HI) get reserved PROT_NONE once and
+ * chunks are carved out of that here:
+ *   - free extents are kept twice, sorted by address (to coalesce) and by
+ *     size (best fit), both binary searched
+ *   - a chunk is committed by mapping over its part of the reservation with
+ *     MAP_FIXED and freed by mapping PROT_NONE back over it
+ *   - fixed addresses (FFI_THUNK_BASE, HCRT_BASE, HDRCACHE_BASE and the cache
+ *     files mapfile() puts there) are claimed out of the window
+ * Data chunks come from the window too as long as a quarter of it stays free
+ * for code, past that they go anywhere. Code that doesn't fit (or if the
+ * window can't be reserved, on kernels that treat MAP_FIXED_NOREPLACE as a
+ * hint) is MAP_32BIT and findregion() like before.
+ * The window only spans 768MB so the rest of the low 2GB is left alone:
+ * below WIN_LO for brk and non-PIE images, [1GB, 2GB) for MAP_32BIT, which
+ * is where x86-64 Linux puts it[1].
+ */
+#define WIN_LO    FFI_THUNK_BASE
+#define WIN_HI    (UINT64_C(1) << 30)
+#define WIN_GRAIN UINT64_C(0x10000)
+
+typedef struct {
+  u64 addr, sz;
+} CExtent;
+
+static struct {
+  pthread_mutex_t mtx;
+  pthread_once_t once;
+  u64 pagsz, total, free;
+  bool hintonly;
+  /* the same free extents twice, by addr and by (sz, addr) */
+  CExtent *byaddr, *bysz;
+  u64 cnt, cap;
+} win = {
+    .mtx = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+};
+
+/* first extent at or after addr */
+static u64 lbaddr(u64 addr) {
+  u64 lo = 0, hi = win.cnt;
+  while (lo < hi) {
+    u64 mid = (lo + hi) / 2;
+    if (win.byaddr[mid].addr < addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* first extent not smaller than sz (ties by addr) */
+static u64 lbsz(u64 sz, u64 addr) {
+  u64 lo = 0, hi = win.cnt;
+  while (lo < hi) {
+    u64 mid = (lo + hi) / 2;
+    CExtent *e = win.bysz + mid;
+    if (e->sz < sz || (e->sz == sz && e->addr < addr))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static bool extins(u64 addr, u64 sz) {
+  if (win.cnt == win.cap) {
+    u64 cap = win.cap ? win.cap * 2 : 64;
+    CExtent *a = realloc(win.byaddr, cap * sizeof *a);
+    if (a)
+      win.byaddr = a;
+    CExtent *b = realloc(win.bysz, cap * sizeof *b);
+    if (b)
+      win.bysz = b;
+    if (!a || !b)
+      return false;
+    win.cap = cap;
+  }
+  CExtent e = {addr, sz};
+  u64 i = lbaddr(addr), j = lbsz(sz, addr);
+  memmove(win.byaddr + i + 1, win.byaddr + i, (win.cnt - i) * sizeof e);
+  memmove(win.bysz + j + 1, win.bysz + j, (win.cnt - j) * sizeof e);
+  win.byaddr[i] = win.bysz[j] = e;
+  win.cnt++;
+  return true;
+}
+
+static void extdel(CExtent e) {
+  u64 i = lbaddr(e.addr), j = lbsz(e.sz, e.addr);
+  win.cnt--;
+  memmove(win.byaddr + i, win.byaddr + i + 1, (win.cnt - i) * sizeof e);
+  memmove(win.bysz + j, win.bysz + j + 1, (win.cnt - j) * sizeof e);
+}
+
+/* give [addr, addr+sz) back, merging with its neighbors */
+static void extfree(u64 addr, u64 sz) {
+  u64 i = lbaddr(addr);
+  win.free += sz;
+  if (i < win.cnt && addr + sz == win.byaddr[i].addr) {
+    CExtent next = win.byaddr[i];
+    extdel(next);
+    sz += next.sz;
+  }
+  if (i && win.byaddr[i - 1].addr + win.byaddr[i - 1].sz == addr) {
+    CExtent prev = win.byaddr[i - 1];
+    extdel(prev);
+    addr = prev.addr, sz += prev.sz;
+  }
+  /* only fails on OOM, the range just leaks */
+  extins(addr, sz);
+}
+
+/* align is only ever the page size or HUGE_SZ, walking up the size order
+ * until an extent fits an aligned chunk is short in practice */
+static u64 exttake(u64 sz, u64 align) {
+  for (u64 j = lbsz(sz, 0); j < win.cnt; j++) {
+    CExtent e = win.bysz[j];
+    u64 at = ALIGNNUM(e.addr, align);
+    if (at + sz > e.addr + e.sz)
+      continue;
+    extdel(e);
+    if (at > e.addr)
+      extins(e.addr, at - e.addr);
+    if (e.addr + e.sz > at + sz)
+      extins(at + sz, e.addr + e.sz - (at + sz));
+    win.free -= sz;
+    return at;
+  }
+  return 0;
+}
+
+static int extclaim(u64 at, u64 sz) {
+  if (at < WIN_LO || at + sz > WIN_HI || at + sz < at)
+    return VCHUNK_OUTSIDE;
+  u64 i = lbaddr(at + 1);
+  if (!i)
+    return VCHUNK_TAKEN;
+  CExtent e = win.byaddr[i - 1];
+  if (at + sz > e.addr + e.sz)
+    return VCHUNK_TAKEN;
+  extdel(e);
+  if (at > e.addr)
+    extins(e.addr, at - e.addr);
+  if (e.addr + e.sz > at + sz)
+    extins(at + sz, e.addr + e.sz - (at + sz));
+  win.free -= sz;
+  return VCHUNK_CLAIMED;
+}
+
+/* PROT_NONE over [addr, addr+sz), MAP_NORESERVE so it costs no commit */
+static bool winreserve(u64 addr, u64 sz, bool fixed) {
+  u8 *p = MMAP(addr, sz, PROT_NONE,
+               FLAGS | MAP_NORESERVE | (fixed ? MAP_FIXED : FIXED_EXCL));
+  if (p == MAP_FAILED)
+    return false;
+  if ((u64)p != addr) {
+    munmap(p, sz);
+    win.hintonly = true;
+    return false;
+  }
+  return true;
+}
+
+/* split around whatever is already mapped, a few dozen mmaps per obstacle */
+static void winreserverange(u64 lo, u64 hi) {
+  if (win.hintonly || hi - lo < WIN_GRAIN)
+    return;
+  if (winreserve(lo, hi - lo, false)) {
+    extfree(lo, hi - lo);
+    win.total += hi - lo;
+    return;
+  }
+  if (win.hintonly || hi - lo < 2 * WIN_GRAIN)
+    return;
+  u64 mid = lo + ALIGNNUM((hi - lo) / 2 - WIN_GRAIN + 1, WIN_GRAIN);
+  winreserverange(lo, mid);
+  winreserverange(mid, hi);
+}
+
+static void wininit(void) {
+  win.pagsz = sysconf(_SC_PAGESIZE);
+  winreserverange(WIN_LO, WIN_HI);
+  if (win.hintonly) { /* undo, fall back to findregion() */
+    for (u64 i = 0; i < win.cnt; i++)
+      munmap((void *)win.byaddr[i].addr, win.byaddr[i].sz);
+    win.cnt = win.total = win.free = 0;
+  }
+}
+
+static u64 wintake(u64 sz, u64 align, bool exec) {
+  u64 ret = 0;
+  pthread_mutex_lock(&win.mtx);
+  if (exec || (win.free >= sz && win.free - sz >= win.total / 4))
+    ret = exttake(sz, align);
+  pthread_mutex_unlock(&win.mtx);
+  return ret;
+}
+
+static void wingive(u64 addr, u64 sz) {
+  winreserve(addr, sz, true);
+  pthread_mutex_lock(&win.mtx);
+  extfree(addr, sz);
+  pthread_mutex_unlock(&win.mtx);
+}
+
+static bool inwin(u64 addr) {
+  return win.total && WIN_LO <= addr && addr < WIN_HI;
+}
+
+/* Huge pages (--hugepages)
+ *
+ * Chunks of at least HUGE_MIN get rounded up to HUGE_SZ multiples (MemPagAlloc
+ * hands the slack to the heap, q.v. VirtualChunkSz) and placed HUGE_SZ aligned
+ * so the kernel can back them with 2MiB pages, either hugetlbfs pages from
+ * MAP_HUGETLB or, when the pool is empty (the default), THP via madvise.
+ * FreeBSD promotes aligned chunks to superpages on its own.
+ */
+#define HUGE_SZ  MiB(2)
+#define HUGE_MIN (HUGE_SZ / 2)
+
+static struct {
+  bool on;
+  /* live bytes, bytes in huge aligned chunks, MAP_HUGETLB/madvise'd chunks */
+  _Atomic(u64) bytes, huge_bytes, tlb, thp;
+} huge;
+
+void HugePagesEnable(void) {
+  huge.on = true;
+}
+
+static bool ishuge(u64 sz) {
+  return huge.on && sz >= HUGE_MIN;
+}
+
+u64 VirtualChunkSz(u64 sz) {
+  pthread_once(&win.once, wininit);
+  u64 align = ishuge(sz) ? HUGE_SZ : win.pagsz;
+  return ALIGNNUM(sz, align);
+}
+
+void HugePagesStats(u64 *out) {
+  out[0] = huge.bytes, out[1] = huge.huge_bytes;
+  out[2] = huge.tlb, out[3] = huge.thp;
+}
+
+static u8 *hugetlb(u8 *hint, u64 sz, int prot, int flags) {
+#ifdef MAP_HUGETLB
+  u8 *ret = MMAP(hint, sz, prot, flags | MAP_HUGETLB);
+  if (ret != MAP_FAILED)
+    huge.tlb++;
+  return ret;
+#else
+  return MAP_FAILED;
+#endif
+}
+
+static u8 *thp(u8 *ret, u64 sz) {
+#ifdef MADV_HUGEPAGE
+  if (ret != MAP_FAILED && !madvise(ret, sz, MADV_HUGEPAGE))
+    huge.thp++;
+#else
+  (void)sz;
+#endif
+  return ret;
+}
+
+/* at is a HUGE_SZ aligned part of the window */
+static u8 *hugemapat(u64 at, u64 sz, int prot) {
+  u8 *ret = hugetlb((u8 *)at, sz, prot, FLAGS | MAP_FIXED);
+  if (ret != MAP_FAILED)
+    return ret;
+  return thp(MMAP(at, sz, prot, FLAGS | MAP_FIXED), sz);
+}
+
+/* anywhere, over-reserve and trim to get it aligned */
+static u8 *hugemapany(u64 sz, int prot) {
+  u8 *ret = hugetlb(NULL, sz, prot, FLAGS);
+  if (ret != MAP_FAILED)
+    return ret;
+  u8 *p = MMAP(NULL, sz + HUGE_SZ, PROT_NONE, FLAGS | MAP_NORESERVE);
+  if (p == MAP_FAILED)
+    return MAP_FAILED;
+  u8 *at = (u8 *)ALIGNNUM((u64)p, HUGE_SZ);
+  if (at > p)
+    munmap(p, at - p);
+  munmap(at + sz, p + HUGE_SZ - at);
+  return thp(MMAP(at, sz, prot, FLAGS | MAP_FIXED), sz);
+}
+
+static void *chunkdone(u8 *ret, u64 sz) {
+  if (ret == MAP_FAILED)
+    return NULL;
+  huge.bytes += sz;
+  if (!(sz % HUGE_SZ) && !((u64)ret % HUGE_SZ))
+    huge.huge_bytes += sz;
+  return ret;
+}
+
+static void chunkgone(void *ptr, u64 sz) {
+  huge.bytes -= sz;
+  if (!(sz % HUGE_SZ) && !((u64)ptr % HUGE_SZ))
+    huge.huge_bytes -= sz;
+}
 
 void *NewVirtualChunk(u64 sz, bool exec) {
-  static u64 pagsz;
-  if (veryunlikely(!pagsz))
-    pagsz = sysconf(_SC_PAGESIZE);
-  sz = ALIGNNUM(sz, pagsz);
+  sz = VirtualChunkSz(sz);
+  bool big = ishuge(sz);
+  int prot = exec ? PROT | PROT_EXEC : PROT;
   u8 *ret;
+  if (win.total) {
+    u64 at = wintake(sz, big ? HUGE_SZ : win.pagsz, exec);
+    if (at) {
+      ret = big ? hugemapat(at, sz, prot)
+                : MMAP(at, sz, prot, FLAGS | MAP_FIXED);
+      if (ret != MAP_FAILED)
+        return chunkdone(ret, sz);
+      wingive(at, sz);
+      return NULL;
+    }
+  }
+  if (big && !exec)
+    return chunkdone(hugemapany(sz, prot), sz);
   if (exec) {
 #ifdef MAP_32BIT
-    ret = MMAP(NULL, sz, PROT | PROT_EXEC, FLAGS | MAP_32BIT);
+    ret = MMAP(NULL, sz, prot, FLAGS | MAP_32BIT);
     if (verylikely(ret != MAP_FAILED))
-      return ret;
+      return chunkdone(ret, sz);
 #endif
     /* Refer to posix/shims.c */
     u64 res = findregion(sz);
     if (veryunlikely(res == -1ul))
       return NULL;
-    ret = MMAP(res, sz, PROT | PROT_EXEC, FLAGS | MAP_FIXED);
+    ret = MMAP(res, sz, prot, FLAGS | MAP_FIXED);
   } else
-    ret = MMAP(NULL, sz, PROT, FLAGS);
+    ret = MMAP(NULL, sz, prot, FLAGS);
+  return chunkdone(ret, sz);
+}
+
+int ClaimVirtualChunk(void *at, u64 sz) {
+  pthread_once(&win.once, wininit);
+  if (!win.total)
+    return VCHUNK_OUTSIDE;
+  sz = ALIGNNUM(sz, win.pagsz);
+  pthread_mutex_lock(&win.mtx);
+  int ret = extclaim((u64)at, sz);
+  pthread_mutex_unlock(&win.mtx);
+  if (ret == VCHUNK_CLAIMED)
+    chunkdone(at, sz);
+  return ret;
+}
+
+void *NewVirtualChunkAt(void *at, u64 sz, bool exec) {
+  int claim = ClaimVirtualChunk(at, sz);
+  sz = ALIGNNUM(sz, win.pagsz);
+  int prot = exec ? PROT | PROT_EXEC : PROT;
+  if (claim == VCHUNK_TAKEN)
+    return NULL;
+  if (claim == VCHUNK_CLAIMED) {
+    u8 *ret = MMAP(at, sz, prot, FLAGS | MAP_FIXED);
+    if (ret != MAP_FAILED)
+      return ret;
+    FreeVirtualChunkAt(at, sz);
+    return NULL;
+  }
+  u8 *ret = MMAP(at, sz, prot, FLAGS | FIXED_EXCL);
   if (ret == MAP_FAILED)
     return NULL;
-  return ret;
+  /* kernels that don't know MAP_FIXED_NOREPLACE treat it as a hint */
+  if (ret != at) {
+    munmap(ret, sz);
+    return NULL;
+  }
+  return chunkdone(ret, sz);
+}
+
+void FreeVirtualChunkAt(void *ptr, u64 sz) {
+  pthread_once(&win.once, wininit);
+  sz = ALIGNNUM(sz, win.pagsz);
+  chunkgone(ptr, sz);
+  if (inwin((u64)ptr))
+    wingive((u64)ptr, sz);
+  else
+    munmap(ptr, sz);
 }
 
 void FreeVirtualChunk(void *ptr, u64 sz) {
-  munmap(ptr, sz);
+  FreeVirtualChunkAt(ptr, VirtualChunkSz(sz));
 }
+
+/* CITATIONS:
+ * [1] https://github.com/torvalds/linux/blob/master/arch/x86/kernel/sys_x86_64.c
+ *     (find_start_end(), MAP_32BIT is 0x40000000-0x80000000)
+ */
@@ -11,8 +11,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <map/map.h>
-
 #include <exodus/abi.h>
 #include <exodus/backtrace.h>
 #include <exodus/dbg.h>
@@ -53,10 +51,10 @@ static void routine(int sig, argign siginfo_t *siginfo, void *_ctx) {
   };
 #endif
   BackTrace(regs[5] /*RBP*/, regs[15] /*RIP*/);
-  static CSymbol *sym;
-  if (!sym)
-    sym = map_get(&symtab, "DebuggerLand");
-  fficall(sym->val, sig, regs);
+  static void *fp;
+  if (!fp)
+    fp = SymFind("DebuggerLand")->val;
+  fficall(fp, sig, regs);
 }
 
 void SetupDebugger(void) {
@@ -32,6 +32,7 @@
 #include <exodus/loader.h>
 #include <exodus/main.h>
 #include <exodus/misc.h>
+#include <exodus/profiler.h>
 #include <exodus/seth.h>
 #include <exodus/shims.h>
 #include <exodus/types.h>
@@ -40,7 +41,7 @@
 typedef struct {
   pthread_t thread;
   /*
-   * Is this thread sleeping?
+   * Is this thread sleeping? 0 no, 1 yes, 2 woken before it got there
    * On all platforms, futexes are four-byte integers
    * that must be aligned on a four-byte boundary.
    * -- man 2 futex
@@ -52,6 +53,9 @@ typedef struct {
   /* U0 (*profiler_int)(U8 *rip) */
   void *profiler_int;
   timer_t profile_timer;
+  /* host-side sampler (q.v. profiler.c) */
+  timer_t sample_timer;
+  bool sampling;
   /* HolyC function pointers it needs to execute on launch
    * (especially important for Core 0) */
   vec_void_t funcptrs;
@@ -59,8 +63,29 @@ typedef struct {
 
 static CCore cores[MP_PROCESSORS_NUM];
 static _Thread_local CCore *self;
+static u64 nproc;
 static u64 pf_prof_active;
 
+/* q.v. Tickless IRQ 0 */
+static struct {
+  /* &cnts.jiffies, cnts.timer follows */
+  i64 *cnts;
+  i64 jiffies0, timer0;
+  struct timespec ts0;
+  /* cores not asleep in SleepMillis() */
+  _Atomic(u32) awake;
+  /* earliest jiffy someone's due at, INT64_MAX if none, q.v. WakeAtJiffy() */
+  _Atomic(i64) next_wake;
+  /* bumped when next_wake moves earlier, the PIT thread waits on it */
+  _Atomic(u32) wake_seq;
+} clk = {.next_wake = INT64_MAX};
+
+/* sigev_value of the SIGPROF timers so profcb knows which one fired */
+enum {
+  PROF_INT,
+  PROF_SAMPLER,
+};
+
 #define masksignals(a, va...) masksignals(a, (int[]){va, 0})
 static void (masksignals)(int how, int *sigs) {
   int i;
@@ -73,11 +98,11 @@ static void (masksignals)(int how, int *sigs) {
 
 // CTRL+C equiv. in TempleOS
 static void ctrlaltc(argign int sig) {
-  static CSymbol *sym;
+  static void *fp;
   masksignals(SIG_UNBLOCK, SIGUSR1);
-  if (!sym)
-    sym = map_get(&symtab, "Yield");
-  fficall(sym->val);
+  if (!fp)
+    fp = SymFind("Yield")->val;
+  fficall(fp);
 }
 
 static void div0(argign int sig) {
@@ -135,12 +160,12 @@ void InterruptCore(u64 core) {
 }
 
 void CreateCore(vec_void_t ptrs) {
-  static int n = 0;
-  CCore *c = cores + n;
+  CCore *c = cores + nproc;
   *c = (CCore){
       .funcptrs = ptrs,
-      .core_num = n,
+      .core_num = nproc,
   };
+  __atomic_fetch_add(&clk.awake, 1, __ATOMIC_RELAXED);
   pthread_create(&c->thread, NULL, ThreadRoutine, c);
   char buf[0x10];
   snprintf(buf, sizeof buf, "Seth(Core%d)", c->core_num);
@@ -148,52 +173,106 @@ void CreateCore(vec_void_t ptrs) {
    * maybe: reference libc/thread/pthread_setname_np.c
    *        in cosmopolitan libc for future ports */
   pthread_setname_np(c->thread, buf);
-  n++;
+  nproc++;
 }
 
-/* porting IRQ_TIMER and firing the signal to all Seth threads
+#ifdef __linux__
+  #define Awake(l) syscall(SYS_futex, l, FUTEX_WAKE, 1u, NULL, NULL, 0)
+  #define Sleep(l, val, t...) syscall(SYS_futex, l, FUTEX_WAIT, val, t, NULL, 0)
+#elif defined(__FreeBSD__)
+  #define Awake(l) _umtx_op(l, UMTX_OP_WAKE, 1u, NULL, NULL)
+  #define Sleep(l, val, t...) \
+    _umtx_op(l, UMTX_OP_WAIT_UINT, val, (void *)sizeof(struct timespec), t)
+#endif
+
+/* Tickless IRQ 0
+ *
+ * cnts.jiffies and cnts.timer used to be bumped by a 1kHz timer signal
+ * calling IntCore0TimerHndlr, idle or not. Now they're derived from
+ * CLOCK_MONOTONIC (vDSO, no syscall) and stored straight into cnts by
+ * whoever needs them fresh:
+ *   - a core coming back from SleepMillis(), the Seth idle loop sleeps
+ *     until the earliest wake_jiffy so the task is due right away
+ *   - SysTimerRead(), for sub-millisecond timing
+ *   - the PIT thread, for tasks Sleep()ing behind busy ones. Busy cores
+ *     post their earliest wake_jiffy with WakeAtJiffy() (SleepUntil and
+ *     CoreAPSethTask) and it sleeps until then. With nothing posted it
+ *     still syncs every PIT_POLL_MS while some core is awake, for code
+ *     spinning on cnts.jiffies without a Yield (Shrine's Tcp.HC, say)
+ * When every core is idle nothing ticks at all.
+ *
+ * porting IRQ_TIMER and firing the signal to all Seth threads
  * was an option, but that introduced way too much lag and
  * HANDLE_SYSF_KEY_EVENT didn't like it */
-static void irq0(argign int sig) {
-  static void *fp;
-  static i64 prev;
+#define SYS_TIMER_FREQ (18333 * 65536 / 1000) // KernelA.HH
+
+/* several cores might race to store, never let the counters go back */
+static void storemax(i64 *p, i64 v) {
+  i64 old = __atomic_load_n(p, __ATOMIC_RELAXED);
+  while (old < v && !__atomic_compare_exchange_n(p, &old, v, true,
+                                                 __ATOMIC_RELAXED,
+                                                 __ATOMIC_RELAXED))
+    ;
+}
+
+static void JiffiesSync(void) {
   struct timespec ts;
-  i64 ms;
-  if (veryunlikely(!fp))
-    fp = map_get(&symtab, "IntCore0TimerHndlr")->val;
+  if (veryunlikely(!clk.cnts))
+    return;
   clock_gettime(CLOCK_MONOTONIC, &ts);
-  ms = ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
-  /* FreeBSD's tick resolution is abysmal
-   * (~10ms with inconsistencies from my observations)
-   * and it's probably only adjustable in sysctl or some other
-   * kernel config so we must adjust between the fired signal intervals
-   *
-   * "it’s probably best to assume a resolution of 10 ms."
-   *     ──Quoth FreeBSD Forums[1]
-   */
-  fficall(fp, prev ? ms - prev : 1);
-  prev = ms;
+  i64 s = ts.tv_sec - clk.ts0.tv_sec, ns = ts.tv_nsec - clk.ts0.tv_nsec;
+  if (ns < 0)
+    s--, ns += 1000000000;
+  storemax(clk.cnts, clk.jiffies0 + s * 1000 + ns / 1000000);
+  storemax(clk.cnts + 1, clk.timer0 + s * SYS_TIMER_FREQ
+                             + ns * SYS_TIMER_FREQ / 1000000000);
+}
+
+u64 SysTimerRead(void) {
+  JiffiesSync();
+  return clk.cnts ? __atomic_load_n(clk.cnts + 1, __ATOMIC_RELAXED) : 0;
+}
+
+#define PIT_POLL_MS 10
+
+void WakeAtJiffy(i64 jiffy) {
+  i64 old = __atomic_load_n(&clk.next_wake, __ATOMIC_RELAXED);
+  while (jiffy < old) {
+    if (__atomic_compare_exchange_n(&clk.next_wake, &old, jiffy, true,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      __atomic_fetch_add(&clk.wake_seq, 1, __ATOMIC_RELEASE);
+      Awake(&clk.wake_seq);
+      return;
+    }
+  }
 }
 
 /* emulate PIT interrupt (IRQ 0) */
 static void *pit_thrd(argign void *arg) {
-  const struct sigaction sa = {.sa_handler = irq0};
-  sigaction(SIGALRM, &sa, NULL);
-  struct sigevent ev = {
-      .sigev_notify = SIGEV_THREAD_ID,
-      .sigev_signo = SIGALRM,
-      .sigev_notify_thread_id = getthreadid(),
-  };
-  timer_t t;
-  timer_create(CLOCK_MONOTONIC, &ev, &t);
-  /* on real TempleOS, SYS_TIMER0_PERIOD is 1192Hz (~839μs/it) */
-  struct itimerspec in = {
-      .it_value.tv_nsec = 1e6,
-      .it_interval.tv_nsec = 1e6,
-  };
-  timer_settime(t, 0, &in, NULL);
-  while (true)
-    pause();
+  while (true) {
+    if (!__atomic_load_n(&clk.awake, __ATOMIC_ACQUIRE)) {
+      Sleep(&clk.awake, 0u, NULL);
+      continue;
+    }
+    /* seq before next_wake, a WakeAtJiffy() in between then fails the wait */
+    u32 seq = __atomic_load_n(&clk.wake_seq, __ATOMIC_ACQUIRE);
+    JiffiesSync();
+    i64 now = __atomic_load_n(clk.cnts, __ATOMIC_RELAXED),
+        next = __atomic_load_n(&clk.next_wake, __ATOMIC_ACQUIRE);
+    if (next <= now) {
+      /* fired, whoever is still sleeping posts again from its Seth task */
+      __atomic_compare_exchange_n(&clk.next_wake, &next, INT64_MAX, false,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+      continue;
+    }
+    /* FreeBSD's ~10ms tick resolution[1] only costs granularity,
+     * the counters are recomputed from scratch on every sync */
+    i64 ms = Min(next - now, PIT_POLL_MS);
+    Sleep(&clk.wake_seq, seq,
+          &(struct timespec){
+              .tv_nsec = ms * 1000000,
+          });
+  }
   return NULL;
 }
 
@@ -201,39 +280,54 @@ void InitIRQ0(void) {
   static bool init;
   if (init)
     return;
+  clk.cnts = (i64 *)SymFind("cnts")->val;
+  clk.jiffies0 = clk.cnts[0];
+  clk.timer0 = clk.cnts[1];
+  clock_gettime(CLOCK_MONOTONIC, &clk.ts0);
   pthread_t t;
   pthread_create(&t, NULL, pit_thrd, NULL);
   pthread_setname_np(t, "PIT (IRQ 0)");
   init = true;
 }
 
-#ifdef __linux__
-  #define Awake(l) syscall(SYS_futex, l, FUTEX_WAKE, 1u, NULL, NULL, 0)
-#elif defined(__FreeBSD__)
-  #define Awake(l) _umtx_op(l, UMTX_OP_WAKE, 1u, NULL, NULL)
-#endif
-
+/* AddrWake() and JobQue() call this right after making a task runnable, the
+ * target core may be between scanning its tasks and SleepMillis() so leave a
+ * note for it instead of losing the wakeup */
 void WakeCoreUp(u64 core) {
   CCore *c = cores + core;
-  if (LBtr(&c->is_sleeping, 0))
+  if (__atomic_exchange_n(&c->is_sleeping, 2u, __ATOMIC_ACQ_REL) == 1)
     Awake(&c->is_sleeping);
 }
 
-#ifdef __linux__
-  #define Sleep(l, val, t...) syscall(SYS_futex, l, FUTEX_WAIT, val, t, NULL, 0)
-#elif defined(__FreeBSD__)
-  #define Sleep(l, val, t...) \
-    _umtx_op(l, UMTX_OP_WAIT_UINT, val, (void *)sizeof(struct timespec), t)
-#endif
+void WakeIdleCore(void) {
+  for (u64 i = 0; i < nproc; i++) {
+    CCore *c = cores + i;
+    if (c != self && __atomic_load_n(&c->is_sleeping, __ATOMIC_RELAXED) == 1) {
+      WakeCoreUp(i);
+      return;
+    }
+  }
+}
 
 void SleepMillis(u64 ms) {
   CCore *c = self;
-  LBts(&c->is_sleeping, 0);
+  u32 awake = 0;
+  if (!__atomic_compare_exchange_n(&c->is_sleeping, &awake, 1u, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n(&c->is_sleeping, 0u, __ATOMIC_RELEASE);
+    JiffiesSync();
+    return;
+  }
+  __atomic_fetch_sub(&clk.awake, 1, __ATOMIC_RELEASE);
   Sleep(&c->is_sleeping, 1u,
         &(struct timespec){
             .tv_nsec = (ms % 1000) * 1e6,
             .tv_sec = ms / 1e3,
         });
+  __atomic_store_n(&c->is_sleeping, 0u, __ATOMIC_RELEASE);
+  if (!__atomic_fetch_add(&clk.awake, 1, __ATOMIC_ACQUIRE))
+    Awake(&clk.awake);
+  JiffiesSync();
 }
 
 #ifdef __linux__
@@ -246,9 +340,14 @@ void SleepMillis(u64 ms) {
   #define RegRbp REG(rbp)
 #endif
 
-static void profcb(argign int sig, argign siginfo_t *info, void *_ctx) {
+static void profcb(argign int sig, siginfo_t *info, void *_ctx) {
   CCore *c = self;
   ucontext_t *ctx = _ctx;
+  /* no FFI calls here, ProfSample() only touches this core's ring */
+  if (info->si_value.sival_int == PROF_SAMPLER) {
+    ProfSample(c->core_num, (u8 *)RegRip, (u8 *)RegRbp);
+    return;
+  }
   if (RegRip > INT32_MAX) // crude check for HolyC
     return;
   /* fake RBP because profcb is called from the kernel and
@@ -257,25 +356,48 @@ static void profcb(argign int sig, argign siginfo_t *info, void *_ctx) {
   fficallcustombp(RegRbp, c->profiler_int, RegRip);
 }
 
+static void armtimer(CCore *c, timer_t *t, int kind, i64 freq) {
+  struct sigevent ev = {
+      .sigev_notify = SIGEV_THREAD_ID,
+      .sigev_signo = SIGPROF,
+      .sigev_value.sival_int = kind,
+      .sigev_notify_thread_id = c->tid,
+  };
+  timer_create(CLOCK_MONOTONIC, &ev, t);
+  struct timespec ts = {
+      .tv_sec = freq / 1000000,
+      .tv_nsec = freq % 1000000 * 1000,
+  };
+  struct itimerspec in = {
+      .it_value = ts,
+      .it_interval = ts,
+  };
+  timer_settime(*t, 0, &in, NULL);
+}
+
+static void disarmtimer(timer_t t) {
+  timer_settime(t, 0, &(struct itimerspec){0}, NULL);
+  timer_delete(t);
+}
+
 void MPSetProfilerInt(void *fp, i64 idx, i64 freq) {
   CCore *c = cores + idx;
   if (fp) {
     c->profiler_int = fp;
-    struct sigevent ev = {
-        .sigev_notify = SIGEV_THREAD_ID,
-        .sigev_signo = SIGPROF,
-        .sigev_notify_thread_id = c->tid,
-    };
-    timer_create(CLOCK_MONOTONIC, &ev, &c->profile_timer);
-    struct itimerspec in = {
-        .it_value.tv_nsec = freq * 1e3,
-        .it_interval.tv_nsec = freq * 1e3,
-    };
-    timer_settime(c->profile_timer, 0, &in, NULL);
+    armtimer(c, &c->profile_timer, PROF_INT, freq);
     LBts(&pf_prof_active, idx);
   } else if (LBtr(&pf_prof_active, idx)) {
-    timer_settime(c->profile_timer, 0, &(struct itimerspec){0}, NULL);
-    timer_delete(c->profile_timer);
+    disarmtimer(c->profile_timer);
+  }
+}
+
+void MPSetSampler(i64 freq) {
+  for (u64 i = 0; i < nproc; i++) {
+    CCore *c = cores + i;
+    if (c->sampling)
+      disarmtimer(c->sample_timer);
+    if ((c->sampling = freq > 0))
+      armtimer(c, &c->sample_timer, PROF_SAMPLER, freq);
   }
 }
 
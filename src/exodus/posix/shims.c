@@ -30,8 +30,10 @@
   #endif
 #endif
 
+#include <errno.h>
 #include <inttypes.h>
 #include <locale.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -42,6 +44,7 @@
 
 #include <vec/vec.h>
 
+#include <exodus/alloc.h>
 #include <exodus/ffi.h>
 #include <exodus/misc.h>
 #include <exodus/shims.h>
@@ -71,6 +74,58 @@ bool fexists(char const *path) {
   return !access(path, F_OK);
 }
 
+static bool statin(int dirfd, char const *path, CFStat *st) {
+#ifdef STATX_TYPE
+  /* only ask for the fields we use, and don't revalidate network fs */
+  struct statx sx;
+  if (!statx(dirfd, path, AT_STATX_DONT_SYNC,
+             STATX_TYPE | STATX_SIZE | STATX_MTIME, &sx)) {
+    *st = (CFStat){
+        .size = sx.stx_size,
+        .mtime = sx.stx_mtime.tv_sec,
+        .exists = true,
+        .dir = S_ISDIR(sx.stx_mode),
+    };
+    return true;
+  }
+  if (errno != ENOSYS) {
+    *st = (CFStat){0};
+    return false;
+  }
+#endif
+  struct stat s;
+  if (fstatat(dirfd, path, &s, 0)) {
+    *st = (CFStat){0};
+    return false;
+  }
+  *st = (CFStat){
+      .size = s.st_size,
+      .mtime = s.st_mtime,
+      .exists = true,
+      .dir = S_ISDIR(s.st_mode),
+  };
+  return true;
+}
+
+bool statpath(char const *path, CFStat *st) {
+  return statin(AT_FDCWD, path, st);
+}
+
+bool statfd(int fd, CFStat *st) {
+  struct stat s;
+  if (fstat(fd, &s)) {
+    *st = (CFStat){0};
+    return false;
+  }
+  *st = (CFStat){
+      .size = s.st_size,
+      .mtime = s.st_mtime,
+      .exists = true,
+      .dir = S_ISDIR(s.st_mode),
+  };
+  return true;
+}
+
 bool isdir(char const *path) {
   struct stat s;
   stat(path, &s);
@@ -146,6 +201,27 @@ char **listdir(char const *path) {
   return memdup(HolyMAlloc, ls.data, sizeof(char *) * ls.length);
 }
 
+bool statdir(char const *path,
+             void cb(char const *name, CFStat const *st, void *user0),
+             void *user0) {
+  DIR *dir = opendir(path);
+  if (veryunlikely(!dir))
+    return false;
+  struct dirent *ent;
+  CFStat st;
+  /* relative to the open dir, no walking path again per entry */
+  while ((ent = readdir(dir)))
+    if (verylikely(strlen(ent->d_name) <= 37)) {
+      /* listdir() would still give it (dangling symlink, raced unlink),
+       * so do the same with zero size and attrs */
+      if (veryunlikely(!statin(dirfd(dir), ent->d_name, &st)))
+        st.exists = true;
+      cb(ent->d_name, &st, user0);
+    }
+  closedir(dir);
+  return true;
+}
+
 static void fsizecb(struct dirent *e, void *user0) {
   i64 *i = user0;
   if (verylikely(strlen(e->d_name) <= 37))
@@ -198,6 +274,133 @@ bool writefile(char const *path, u8 const *data, i64 sz) {
   return sz == write(fd, data, sz);
 }
 
+void *mapfile(char const *path, u64 off, u64 sz, void *addr) {
+  int cleanup(_closefd) fd = open(path, O_RDONLY);
+  if (veryunlikely(fd == -1))
+    return NULL;
+  /* in the low window it's ours to map over, q.v. posix/alloc.c */
+  int claim = ClaimVirtualChunk(addr, sz);
+  if (claim == VCHUNK_TAKEN)
+    return NULL;
+#ifdef MAP_FIXED_NOREPLACE
+  int flags = MAP_PRIVATE | MAP_FIXED_NOREPLACE;
+#else // FreeBSD
+  int flags = MAP_PRIVATE | MAP_FIXED | MAP_EXCL;
+#endif
+  if (claim == VCHUNK_CLAIMED)
+    flags = MAP_PRIVATE | MAP_FIXED;
+  void *ret =
+      mmap(addr, sz, PROT_READ | PROT_WRITE | PROT_EXEC, flags, fd, off);
+  if (ret == MAP_FAILED) {
+    if (claim == VCHUNK_CLAIMED)
+      FreeVirtualChunkAt(addr, sz);
+    return NULL;
+  }
+  if (ret != addr) { // MAP_FIXED_NOREPLACE is a hint before Linux 4.17
+    munmap(ret, sz);
+    return NULL;
+  }
+  return ret;
+}
+
+/*
+ * File views
+ *
+ * VFsFMap() hands HolyC the file's pages instead of a FileRead() copy.
+ * They're MAP_PRIVATE and writable so code that scribbles on its buffer
+ * still works, and it just COWs. Anonymous zero pages go under the
+ * mapping for the terminating 0 FileRead() promises, since touching file
+ * pages past EOF is SIGBUS.
+ *
+ * A private mapping may still see later writes to the file[2], so before
+ * VFs writes to a file that has views they are swapped for plain copies
+ * (detachviews). Writes from outside EXODUS aren't caught.
+ */
+typedef struct {
+  u8 *addr;
+  u64 sz;
+  /* 0 once detached */
+  dev_t dev;
+  ino_t ino;
+} CView;
+
+static struct {
+  pthread_mutex_t mtx;
+  vec_t(CView) v;
+} views = {.mtx = PTHREAD_MUTEX_INITIALIZER};
+
+void *mapview(char const *path, u64 *lenp) {
+  int cleanup(_closefd) fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) || !S_ISREG(st.st_mode))
+    return NULL;
+  u64 pag = sysconf(_SC_PAGESIZE), sz = st.st_size + 1;
+  sz = ALIGNNUM(sz, pag);
+  u8 *p = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (veryunlikely(p == MAP_FAILED))
+    return NULL;
+  if (st.st_size) {
+    if (MAP_FAILED == mmap(p, st.st_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_FIXED, fd, 0)) {
+      munmap(p, sz);
+      return NULL;
+    }
+    /* WADs and ISOs get read front to back, start the readahead now */
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    madvise(p, st.st_size, MADV_WILLNEED);
+  }
+  pthread_mutex_lock(&views.mtx);
+  vec_push(&views.v, ((CView){p, sz, st.st_dev, st.st_ino}));
+  pthread_mutex_unlock(&views.mtx);
+  *lenp = st.st_size;
+  return p;
+}
+
+bool unmapview(void *p) {
+  bool found = false;
+  pthread_mutex_lock(&views.mtx);
+  for (int i = 0; i < views.v.length; i++) {
+    CView *v = views.v.data + i;
+    if (v->addr != p)
+      continue;
+    munmap(v->addr, v->sz);
+    vec_splice(&views.v, i, 1);
+    found = true;
+    break;
+  }
+  pthread_mutex_unlock(&views.mtx);
+  return found;
+}
+
+void detachviews(char const *path) {
+  struct stat st;
+  if (stat(path, &st))
+    return;
+  pthread_mutex_lock(&views.mtx);
+  for (int i = 0; i < views.v.length; i++) {
+    CView *v = views.v.data + i;
+    if (v->dev != st.st_dev || v->ino != st.st_ino)
+      continue;
+    u8 *cp = mmap(NULL, v->sz, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (veryunlikely(cp == MAP_FAILED))
+      continue;
+    memcpy(cp, v->addr, v->sz);
+#ifdef __linux__
+    /* atomic, other cores reading the view never see a hole */
+    mremap(cp, v->sz, v->sz, MREMAP_MAYMOVE | MREMAP_FIXED, v->addr);
+#else
+    mmap(v->addr, v->sz, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    memcpy(v->addr, cp, v->sz);
+    munmap(cp, v->sz);
+#endif
+    v->dev = v->ino = 0;
+  }
+  pthread_mutex_unlock(&views.mtx);
+}
+
 bool seekfd(int fd, i64 off) {
   return -1 != lseek(fd, off, SEEK_SET);
 }
@@ -371,4 +574,7 @@ void prepare(void) {
 /* CITATIONS:
  * [1] https://renatocunha.com/2015/12/msync-pointer-validity/
  *     (https://archive.md/Aj0S4)
+ * [2] https://man7.org/linux/man-pages/man2/mmap.2.html
+ *     (MAP_PRIVATE: "It is unspecified whether changes made to the file
+ *     after the mmap() call are visible in the mapped region.")
  */
@@ -0,0 +1,399 @@
+// vi: set et ft=c ts=2 sts=2 sw=2 fenc=utf-8 :vi
+//
+// Copyright 2024 1fishe2fishe
+// Refer to the LICENSE file for license info.
+// Any citation links are provided at the end of the file.
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vec/vec.h>
+
+#include <exodus/backtrace.h>
+#include <exodus/ffi.h>
+#include <exodus/misc.h>
+#include <exodus/profiler.h>
+#include <exodus/seth.h>
+#include <exodus/shims.h>
+#include <exodus/types.h>
+
+/* Sample layout in the ring (in u64 words, wraps around):
+ *   [depth] [rip] [ret addr] [ret addr] ...
+ * Variable length so shallow stacks don't waste space; 1MiB per core
+ * holds roughly 10-15s of samples at 1kHz before the producer starts
+ * dropping (counted in dropped) */
+#define PROF_DEPTH 32u
+#define PROF_RING  (MiB(1) / sizeof(u64))
+/* a caller's frame is never this far up the stack from its callee's */
+#define PROF_FRAME MiB(1)
+/* canonical pc for samples taken outside of HolyC (SDL, libc, ...) */
+#define HOST_PC 0u
+
+typedef struct {
+  /* written by the sampled core only */
+  u64 head __attribute__((aligned(64)));
+  u64 dropped;
+  /* written by ProfDump only */
+  u64 tail __attribute__((aligned(64)));
+  u64 *buf;
+} CProfRing;
+
+static CProfRing rings[MP_PROCESSORS_NUM];
+static u64 nrings, period;
+
+typedef vec_t(u64) vec_u64_t;
+
+typedef struct {
+  u64 hash, cnt;
+  /* [core] [leaf pc] ... [root pc] in agg.pool */
+  u32 off, len;
+} CStack;
+
+/* drained samples, merged per unique (core, stack) */
+static struct {
+  CStack *ents;
+  u64 cap, cnt, samples;
+  vec_u64_t pool;
+  bool lock;
+} agg;
+
+static bool okframe(u8 **fp, u64 *pag) {
+  /* msync() per frame is expensive so only check when
+   * the walk crosses into a page it hasn't seen yet */
+  for (u64 p = (u64)fp & -0x1000; p <= ((u64)(fp + 1) & -0x1000);
+       p += 0x1000) {
+    if (p == *pag)
+      continue;
+    if (!isvalidptr((void *)p))
+      return false;
+    *pag = p;
+  }
+  return true;
+}
+
+void ProfSample(u64 core, u8 *rip, u8 *rbp) {
+  CProfRing *r = rings + core;
+  if (veryunlikely(!r->buf))
+    return;
+  u64 pcs[PROF_DEPTH], n = 0, pag = 0;
+  u8 **fp = (u8 **)rbp, **next, *ret;
+  pcs[n++] = (u64)rip;
+  /* same walk as BackTrace() but it can't trust anything, we might be
+   * in the middle of a prologue, in asm that clobbers RBP or in C code
+   * compiled without frame pointers */
+  while (n < PROF_DEPTH && fp && !((u64)fp & 7) && okframe(fp, &pag)) {
+    ret = fp[1];
+    if (!ret || (u64)ret > INT32_MAX) // crude check for HolyC
+      break;
+    pcs[n++] = (u64)ret;
+    next = (u8 **)fp[0];
+    /* stack grows down, callers are always further up */
+    if (next <= fp || (u64)next - (u64)fp > PROF_FRAME)
+      break;
+    fp = next;
+  }
+  u64 h = r->head, t = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  if (PROF_RING - (h - t) < n + 1) {
+    __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  r->buf[h++ % PROF_RING] = n;
+  for (u64 i = 0; i < n; i++)
+    r->buf[h++ % PROF_RING] = pcs[i];
+  __atomic_store_n(&r->head, h, __ATOMIC_RELEASE);
+}
+
+void ProfStart(i64 freq) {
+  MPSetSampler(0);
+  /* isvalidptr() caches the page size on first use,
+   * don't let that happen inside the signal handler */
+  isvalidptr(&freq);
+  SymIdxSync();
+  while (LBts(&agg.lock, 0))
+    while (Bt(&agg.lock, 0))
+      __builtin_ia32_pause();
+  free(agg.ents);
+  vec_deinit(&agg.pool);
+  agg = (typeof(agg)){.lock = true};
+  nrings = mp_cnt();
+  for (u64 i = 0; i < nrings; i++) {
+    CProfRing *r = rings + i;
+    if (!r->buf)
+      r->buf = malloc(PROF_RING * sizeof *r->buf);
+    r->head = r->tail = r->dropped = 0;
+  }
+  period = freq;
+  LBtr(&agg.lock, 0);
+  MPSetSampler(freq);
+}
+
+void ProfStop(void) {
+  MPSetSampler(0);
+}
+
+static u64 hashwords(u64 const *w, u64 n) {
+  u64 h = 14695981039346656037u; // FNV-1a
+  while (n--)
+    h = (h ^ *w++) * 1099511628211u;
+  return h ?: 1;
+}
+
+static void aggresize(void) {
+  CStack *old = agg.ents;
+  u64 oldcap = agg.cap;
+  agg.cap = agg.cap ? agg.cap * 2 : 1024;
+  agg.ents = calloc(agg.cap, sizeof *agg.ents);
+  for (u64 i = 0; i < oldcap; i++) {
+    if (!old[i].hash)
+      continue;
+    u64 j = old[i].hash & (agg.cap - 1);
+    while (agg.ents[j].hash)
+      j = (j + 1) & (agg.cap - 1);
+    agg.ents[j] = old[i];
+  }
+  free(old);
+}
+
+static void aggadd(u64 const *key, u64 len) {
+  if (2 * (agg.cnt + 1) > agg.cap)
+    aggresize();
+  u64 hash = hashwords(key, len), i = hash & (agg.cap - 1);
+  CStack *e;
+  for (;; i = (i + 1) & (agg.cap - 1)) {
+    e = agg.ents + i;
+    if (!e->hash)
+      break;
+    if (e->hash == hash && e->len == len &&
+        !memcmp(agg.pool.data + e->off, key, len * sizeof *key)) {
+      e->cnt++;
+      agg.samples++;
+      return;
+    }
+  }
+  *e = (CStack){
+      .hash = hash,
+      .cnt = 1,
+      .off = agg.pool.length,
+      .len = len,
+  };
+  vec_pusharr(&agg.pool, key, len);
+  agg.cnt++;
+  agg.samples++;
+}
+
+/* fold every return address into the function it belongs to
+ * so samples anywhere in the same routine merge */
+static u64 canon(u64 pc) {
+  u64 off;
+  if (pc > INT32_MAX)
+    return HOST_PC;
+  return WhichFunOff((u8 *)pc, &off) ? pc - off : pc;
+}
+
+static void drain(void) {
+  u64 key[PROF_DEPTH + 1], n;
+  for (u64 i = 0; i < nrings; i++) {
+    CProfRing *r = rings + i;
+    u64 t = r->tail, h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    while (t != h) {
+      n = r->buf[t++ % PROF_RING];
+      key[0] = i;
+      for (u64 j = 0; j < n; j++)
+        key[j + 1] = canon(r->buf[t++ % PROF_RING]);
+      aggadd(key, n + 1);
+    }
+    __atomic_store_n(&r->tail, t, __ATOMIC_RELEASE);
+  }
+}
+
+static char const *pcname(u64 pc, char buf[static 24]) {
+  char const *s;
+  u64 off;
+  if (pc == HOST_PC)
+    return "[host]";
+  if ((s = WhichFunOff((u8 *)pc, &off)) && !off)
+    return s;
+  /* JIT'd code (cmd line, user programs) isn't in the symbol table */
+  snprintf(buf, 24, "%#" PRIx64, pc);
+  return buf;
+}
+
+static void putstr(vec_char_t *v, char const *s) {
+  vec_pusharr(v, s, strlen(s));
+}
+
+/* Brendan Gregg's folded stack format[1], one line per unique stack:
+ *   Seth(Core0);root;...;leaf count */
+static void folded(vec_char_t *v) {
+  char buf[24];
+  for (u64 i = 0; i < agg.cap; i++) {
+    CStack *e = agg.ents + i;
+    if (!e->hash)
+      continue;
+    u64 *w = agg.pool.data + e->off;
+    snprintf(buf, sizeof buf, "Seth(Core%" PRIu64 ")", w[0]);
+    putstr(v, buf);
+    for (u64 j = e->len - 1; j > 0; j--) {
+      vec_push(v, ';');
+      putstr(v, pcname(w[j], buf));
+    }
+    snprintf(buf, sizeof buf, " %" PRIu64 "\n", e->cnt);
+    putstr(v, buf);
+  }
+}
+
+/* Minimal protobuf writer for pprof's profile.proto[2] */
+static void pbvar(vec_char_t *v, u64 x) {
+  do {
+    vec_push(v, (x & 0x7f) | (x > 0x7f ? 0x80 : 0));
+    x >>= 7;
+  } while (x);
+}
+
+static void pbint(vec_char_t *v, u64 field, u64 x) {
+  pbvar(v, field << 3 | 0);
+  pbvar(v, x);
+}
+
+static void pbbytes(vec_char_t *v, u64 field, void const *p, u64 len) {
+  pbvar(v, field << 3 | 2);
+  pbvar(v, len);
+  vec_pusharr(v, (char const *)p, len);
+}
+
+/* nested message, built in tmp and copied out */
+static void pbmsg(vec_char_t *v, u64 field, vec_char_t *tmp) {
+  pbbytes(v, field, tmp->data, tmp->length);
+  vec_clear(tmp);
+}
+
+static int compar(void const *_a, void const *_b) {
+  u64 a = *(u64 const *)_a, b = *(u64 const *)_b;
+  return (a > b) - (a < b);
+}
+
+/* location/function ids are the pc's index in pcs + 1 */
+static u64 pcid(u64 const *pcs, u64 cnt, u64 pc) {
+  u64 *p = bsearch(&pc, pcs, cnt, sizeof *pcs, compar);
+  return p - pcs + 1;
+}
+
+enum {
+  STR_EMPTY,
+  STR_SAMPLES,
+  STR_COUNT,
+  STR_CPU,
+  STR_NANOSECONDS,
+  STR_CORE,
+  STR_FIRSTFUN,
+};
+
+static void pprof(vec_char_t *v) {
+  static char const *strs[] = {
+      [STR_EMPTY] = "",          [STR_SAMPLES] = "samples",
+      [STR_COUNT] = "count",     [STR_CPU] = "cpu",
+      [STR_NANOSECONDS] = "nanoseconds", [STR_CORE] = "core",
+  };
+  vec_char_t tmp, tmp2;
+  vec_init(&tmp);
+  vec_init(&tmp2);
+  char buf[24];
+  char const *s;
+  /* every distinct pc is both a location and a function */
+  u64 *pcs = malloc(agg.pool.length * sizeof *pcs), cnt = 0;
+  for (u64 i = 0; i < agg.cap; i++) {
+    CStack *e = agg.ents + i;
+    if (!e->hash)
+      continue;
+    memcpy(pcs + cnt, agg.pool.data + e->off + 1,
+           (e->len - 1) * sizeof *pcs);
+    cnt += e->len - 1;
+  }
+  qsort(pcs, cnt, sizeof *pcs, compar);
+  u64 uniq = 0;
+  for (u64 i = 0; i < cnt; i++)
+    if (!uniq || pcs[uniq - 1] != pcs[i])
+      pcs[uniq++] = pcs[i];
+  cnt = uniq;
+  /* sample_type = {samples, count}
+   * period_type = {cpu, nanoseconds} */
+  pbint(&tmp, 1, STR_SAMPLES);
+  pbint(&tmp, 2, STR_COUNT);
+  pbmsg(v, 1, &tmp);
+  pbint(&tmp, 1, STR_CPU);
+  pbint(&tmp, 2, STR_NANOSECONDS);
+  pbmsg(v, 11, &tmp);
+  pbint(v, 12, period * 1000);
+  /* samples: location_id(leaf first), value, label{core} */
+  for (u64 i = 0; i < agg.cap; i++) {
+    CStack *e = agg.ents + i;
+    if (!e->hash)
+      continue;
+    u64 *w = agg.pool.data + e->off;
+    for (u64 j = 1; j < e->len; j++)
+      pbvar(&tmp2, pcid(pcs, cnt, w[j]));
+    pbmsg(&tmp, 1, &tmp2);
+    pbvar(&tmp2, e->cnt);
+    pbmsg(&tmp, 2, &tmp2);
+    pbint(&tmp2, 1, STR_CORE);
+    pbint(&tmp2, 3, w[0]);
+    pbmsg(&tmp, 3, &tmp2);
+    pbmsg(v, 2, &tmp);
+  }
+  /* locations: id, address, line{function_id} */
+  for (u64 i = 0; i < cnt; i++) {
+    pbint(&tmp, 1, i + 1);
+    pbint(&tmp, 3, pcs[i]);
+    pbint(&tmp2, 1, i + 1);
+    pbmsg(&tmp, 4, &tmp2);
+    pbmsg(v, 4, &tmp);
+  }
+  /* functions: id, name, system_name */
+  for (u64 i = 0; i < cnt; i++) {
+    pbint(&tmp, 1, i + 1);
+    pbint(&tmp, 2, STR_FIRSTFUN + i);
+    pbint(&tmp, 3, STR_FIRSTFUN + i);
+    pbmsg(v, 5, &tmp);
+  }
+  for (u64 i = 0; i < Arrlen(strs); i++)
+    pbbytes(v, 6, strs[i], strlen(strs[i]));
+  for (u64 i = 0; i < cnt; i++) {
+    s = pcname(pcs[i], buf);
+    pbbytes(v, 6, s, strlen(s));
+  }
+  free(pcs);
+  vec_deinit(&tmp);
+  vec_deinit(&tmp2);
+}
+
+u8 *ProfDump(bool pp, u64 *len, u64 *dropped) {
+  vec_char_t v;
+  vec_init(&v);
+  while (LBts(&agg.lock, 0))
+    while (Bt(&agg.lock, 0))
+      __builtin_ia32_pause();
+  SymIdxSync();
+  drain();
+  (pp ? pprof : folded)(&v);
+  if (dropped) {
+    *dropped = 0;
+    for (u64 i = 0; i < nrings; i++)
+      *dropped += __atomic_load_n(&rings[i].dropped, __ATOMIC_RELAXED);
+  }
+  LBtr(&agg.lock, 0);
+  /* HolyMAlloc throws 'OutMem' on failure */
+  u8 *ret = HolyMAlloc(v.length + 1);
+  memcpy(ret, v.data, v.length);
+  ret[v.length] = 0;
+  *len = v.length;
+  vec_deinit(&v);
+  return ret;
+}
+
+/* CITATIONS:
+ * [1] https://github.com/brendangregg/FlameGraph#2-fold-stacks
+ * [2]
+ * https://github.com/google/pprof/blob/main/proto/profile.proto
+ */
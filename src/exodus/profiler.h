@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <exodus/types.h>
+
+/* Host-side sampling profiler. Every core owns a single-producer/
+ * single-consumer ring that is filled straight from the profiling
+ * signal (or the NT profiling timer) without calling into HolyC,
+ * and drained + symbolized on demand by ProfDump() */
+
+/* async-signal-safe, only ever called for one core by one producer */
+void ProfSample(u64 core, u8 *rip, u8 *rbp);
+/* freq is in microseconds */
+void ProfStart(i64 freq);
+void ProfStop(void);
+/* folded stacks (flamegraph.pl, speedscope, ...) or
+ * an uncompressed pprof profile.proto, HolyMAlloc'd */
+u8 *ProfDump(bool pprof, u64 *len, u64 *dropped);
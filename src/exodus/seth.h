@@ -11,7 +11,15 @@ void InterruptCore(u64 core);
 void CreateCore(vec_void_t ptrs);
 
 void WakeCoreUp(u64 n);
+/* wake one other core sleeping in SleepMillis(), if any */
+void WakeIdleCore(void);
 void SleepMillis(u64 ms);
 
 void InitIRQ0(void);
+/* SYS_TIMER_FREQ ticks since boot, also syncs cnts.jiffies/cnts.timer */
+u64 SysTimerRead(void);
+/* have cnts.jiffies synced by the time it reaches jiffy */
+void WakeAtJiffy(i64 jiffy);
 void MPSetProfilerInt(void *fp, i64 idx, i64 freq);
+/* arm ProfSample() on every core, freq in microseconds, 0 disarms */
+void MPSetSampler(i64 freq);
@@ -11,6 +11,19 @@ int openfd(char const *path, bool rw);
 void closefd(int fd);
 bool fexists(char const *path);
 bool isdir(char const *path);
+/* what VFs wants to know about a file, in one syscall */
+typedef struct {
+  i64 size;
+  u64 mtime;
+  bool exists, dir;
+} CFStat;
+/* false (and zeroed *st) if it's not there */
+bool statpath(char const *path, CFStat *st);
+bool statfd(int fd, CFStat *st);
+/* cb for every entry listdir() would give, with its metadata */
+bool statdir(char const *path,
+             void cb(char const *name, CFStat const *st, void *user0),
+             void *user0);
 /* not const because fts has the wrong interface */
 void deleteall(char *path);
 char **listdir(char const *path);
@@ -19,11 +32,20 @@ bool truncfile(char const *path, i64 sz);
 u64 unixtime(char const *path);
 bool readfile(char const *path, u8 *buf, i64 sz);
 bool writefile(char const *path, u8 const *data, i64 sz);
+/* copy-on-write RWX view of [off, off+sz) in path, exactly at addr or NULL */
+void *mapfile(char const *path, u64 off, u64 sz, void *addr);
 i64 fsize(char const *path);
 bool dirmk(char const *path);
 u64 mp_cnt(void);
 void unblocksigs(void);
 bool seekfd(int fd, i64 off);
+/* private view of a whole file with a 0 byte after it, NULL if it can't
+ * be mapped (q.v. File views) */
+void *mapview(char const *path, u64 *lenp);
+/* false if p isn't from mapview() */
+bool unmapview(void *p);
+/* path is about to be written, turn its views into plain copies */
+void detachviews(char const *path);
 bool isvalidptr(void *p);
 void prepare(void);
 i64 getticksus(void);
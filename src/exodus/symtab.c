@@ -0,0 +1,128 @@
+// vi: set et ft=c ts=2 sts=2 sw=2 fenc=utf-8 :vi
+//
+// Copyright 2024 1fishe2fishe
+// Refer to the LICENSE file for license info.
+// Any citation links are provided at the end of the file.
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <exodus/misc.h>
+#include <exodus/symtab.h>
+#include <exodus/types.h>
+
+/* Flat open-addressing (linear probing) hash table
+ *
+ * Every lookup during boot used to go through a chained hash map that
+ * malloced a node per symbol and rehashed the key with djb2 on every probe.
+ * Here entries live inline with their hash and key length so a probe only
+ * touches the slot array, and the key is memcmp'd only on a full hash match.
+ * Keys are interned in an append-only arena since symbols are never removed.
+ *
+ * Load factor is kept <= 1/2 so probe sequences stay short. */
+typedef struct {
+  u32 hash /* 0: empty slot */, len;
+  char const *name;
+  CSymbol sym;
+} CSymEntry;
+
+enum {
+  TAB_MIN = 1024,
+  ARENA_BLK = KiB(64),
+};
+
+static struct {
+  CSymEntry *ents;
+  u64 cap, cnt, gen;
+  char *arena;
+  u64 arena_left;
+} tab;
+
+/* FNV-1a */
+static u32 symhash(char const *s, u32 *len) {
+  u32 h = 2166136261u;
+  char const *p = s;
+  for (; *p; p++)
+    h = (h ^ (u8)*p) * 16777619u;
+  *len = p - s;
+  return h ?: 1;
+}
+
+static CSymEntry *slot(CSymEntry *ents, u64 cap, u32 hash, char const *name,
+                       u32 len) {
+  for (u64 i = hash & (cap - 1);; i = (i + 1) & (cap - 1)) {
+    CSymEntry *e = ents + i;
+    if (!e->hash)
+      return e;
+    if (e->hash == hash && e->len == len && !memcmp(e->name, name, len))
+      return e;
+  }
+}
+
+static char const *intern(char const *s, u32 len) {
+  if (tab.arena_left < len + 1) {
+    tab.arena_left = Max((u64)ARENA_BLK, len + 1ul);
+    tab.arena = malloc(tab.arena_left);
+  }
+  char *ret = memcpy(tab.arena, s, len + 1);
+  tab.arena += len + 1;
+  tab.arena_left -= len + 1;
+  return ret;
+}
+
+static void grow(void) {
+  u64 cap = tab.cap ? tab.cap * 2 : TAB_MIN;
+  CSymEntry *ents = calloc(cap, sizeof *ents);
+  /* hashes are stored so rehashing doesn't touch the keys */
+  for (CSymEntry *e = tab.ents; e != tab.ents + tab.cap; e++)
+    if (e->hash)
+      *slot(ents, cap, e->hash, e->name, e->len) = *e;
+  free(tab.ents);
+  tab.ents = ents;
+  tab.cap = cap;
+}
+
+CSymbol *SymFind(char const *name) {
+  if (veryunlikely(!tab.cnt))
+    return NULL;
+  u32 len, hash = symhash(name, &len);
+  CSymEntry *e = slot(tab.ents, tab.cap, hash, name, len);
+  return e->hash ? &e->sym : NULL;
+}
+
+void SymSet(char const *name, CSymbol sym) {
+  if (veryunlikely((tab.cnt + 1) * 2 > tab.cap))
+    grow();
+  u32 len, hash = symhash(name, &len);
+  CSymEntry *e = slot(tab.ents, tab.cap, hash, name, len);
+  if (!e->hash) {
+    *e = (CSymEntry){
+        .hash = hash,
+        .len = len,
+        .name = intern(name, len),
+    };
+    tab.cnt++;
+  }
+  e->sym = sym;
+  tab.gen++;
+}
+
+char const *SymNext(u64 *it, CSymbol **sym) {
+  for (; *it < tab.cap; ++*it) {
+    CSymEntry *e = tab.ents + *it;
+    if (!e->hash)
+      continue;
+    ++*it;
+    *sym = &e->sym;
+    return e->name;
+  }
+  return NULL;
+}
+
+u64 SymCnt(void) {
+  return tab.cnt;
+}
+
+u64 SymGen(void) {
+  return tab.gen;
+}
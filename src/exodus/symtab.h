@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <exodus/types.h>
+
+typedef struct {
+  u32 type;
+  union {
+    u8 *val; // CHashExport
+    struct {
+      u8 *module_base, *module_header_entry; // CHashImport
+    };
+  };
+} CSymbol;
+
+/* Symbols exported by the kernel and FFI thunks, q.v. symtab.c
+ * Pointers returned by SymFind/SymNext are invalidated by SymSet */
+CSymbol *SymFind(char const *name);
+void SymSet(char const *name, CSymbol sym);
+/* *it = 0 to start, returns NULL when done */
+char const *SymNext(u64 *it, CSymbol **sym);
+u64 SymCnt(void);
+/* bumped on every SymSet, for caches derived from the table */
+u64 SymGen(void);
@@ -8,6 +8,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <vec/vec.h>
+
 #include <exodus/alloc.h>
 #include <exodus/ffi.h>
 #include <exodus/misc.h>
@@ -18,15 +20,72 @@ _Thread_local char thrd_pwd[0x200], thrd_drv;
 
 static char mount_points['z' - 'a' + 1][0x200];
 
-static char *VFsFNameAbs(char const *path) {
-  char *cur, *prev, ret[0x200];
+static void _closefd(int *fd) {
+  if (*fd != -1)
+    closefd(*fd);
+}
+
+/* ret must hold 0x200 bytes */
+static char *VFsFNameAbs(char *ret, char const *path) {
+  char *cur, *prev;
   cur = stpcpy2(ret, mount_points[thrd_drv - 'A']);
   *cur++ = '/';
   cur = stpcpy2(prev = cur, thrd_pwd + 1);
   *cur++ = '/';
   cur -= cur - 1 == prev;
   strcpy(cur, path);
-  return strdup(ret);
+  return ret;
+}
+
+/*
+ * Metadata cache
+ *
+ * VirtFileFind() alone asks VFsFExists, VFsIsDir (up to three times),
+ * VFsFSize and VFsFUnixTime about the same name, and each used to be its
+ * own path walk or two. One statpath() result is kept per slot, per thread
+ * so the cores don't fight over it. Slots go stale when anything changes
+ * the tree through VFs (vfs_gen, q.v. VFsTouched) and after STAT_TTL, so
+ * edits made on the host side still show up quickly.
+ */
+#define STAT_SLOTS 64
+#define STAT_TTL   250000 /* us */
+
+typedef struct {
+  u64 gen;
+  i64 at;
+  u64 hash;
+  CFStat st;
+  char path[0x200];
+} CStatSlot;
+
+static _Thread_local CStatSlot stat_cache[STAT_SLOTS];
+/* 0 marks an empty slot */
+static u64 vfs_gen = 1;
+
+void VFsTouched(void) {
+  __atomic_fetch_add(&vfs_gen, 1, __ATOMIC_RELEASE);
+}
+
+static u64 strhash(char const *s) {
+  u64 h = 0xcbf29ce484222325; /* FNV-1a */
+  while (*s)
+    h = (h ^ (u8)*s++) * 0x100000001b3;
+  return h;
+}
+
+static CStatSlot *VFsStat(char const *path) {
+  u64 h = strhash(path), gen = __atomic_load_n(&vfs_gen, __ATOMIC_ACQUIRE);
+  i64 now = getticksus();
+  CStatSlot *s = stat_cache + h % STAT_SLOTS;
+  if (s->gen == gen && s->hash == h && now - s->at < STAT_TTL &&
+      !strcmp(s->path, path))
+    return s;
+  statpath(path, &s->st);
+  s->gen = gen;
+  s->at = now;
+  s->hash = h;
+  strcpy(s->path, path);
+  return s;
 }
 
 void VFsThrdInit(void) {
@@ -49,91 +108,161 @@ void VFsSetPwd(char const *pwd) {
 }
 
 bool VFsDirMk(char const *to) {
-  char cleanup(_dtor) *p = VFsFNameAbs(to);
-  return fexists(p) ? isdir(p) : dirmk(p);
+  char p[0x200];
+  CStatSlot *s = VFsStat(VFsFNameAbs(p, to));
+  if (s->st.exists)
+    return s->st.dir;
+  VFsTouched();
+  return dirmk(p);
 }
 
-bool VFsDel(char const *p) {
-  char cleanup(_dtor) *path = VFsFNameAbs(p);
-  if (!fexists(path))
+bool VFsDel(char const *to) {
+  char p[0x200];
+  if (!VFsStat(VFsFNameAbs(p, to))->st.exists)
     return false;
-  deleteall(path);
-  return !fexists(path);
+  deleteall(p);
+  VFsTouched();
+  return !fexists(p);
 }
 
 i64 VFsFSize(char const *name) {
-  char cleanup(_dtor) *fn = VFsFNameAbs(name);
-  if (!fexists(fn))
-    return -1;
-  return fsize(fn);
+  char p[0x200];
+  CStatSlot *s = VFsStat(VFsFNameAbs(p, name));
+  /* the host's size for dirs too, same as VFsDirStat() gives */
+  return s->st.exists ? s->st.size : -1;
 }
 
 int VFsFOpen(char const *path, bool rw) {
-  char cleanup(_dtor) *p = VFsFNameAbs(path);
+  char p[0x200];
+  VFsFNameAbs(p, path);
+  if (rw) {
+    VFsTouched();
+    detachviews(p);
+  }
   return openfd(p, rw);
 }
 
+void VFsFClose(int fd) {
+  /* might have been written to, q.v. Metadata cache */
+  VFsTouched();
+  closefd(fd);
+}
+
+i64 VFsFdSize(int fd) {
+  CFStat st;
+  return statfd(fd, &st) ? st.size : -1;
+}
+
 void VFsFTrunc(char const *name, u64 sz) {
-  char *p = VFsFNameAbs(name);
+  char p[0x200];
+  detachviews(VFsFNameAbs(p, name));
   bool b = truncfile(p, sz);
-  free(p);
+  VFsTouched();
   if (veryunlikely(!b))
     HolyThrow("SysError");
 }
 
 u64 VFsFUnixTime(char const *name) {
-  char cleanup(_dtor) *fn = VFsFNameAbs(name);
-  if (!fexists(fn))
-    return 0;
-  return unixtime(fn);
+  char p[0x200];
+  return VFsStat(VFsFNameAbs(p, name))->st.mtime;
 }
 
 bool VFsFWrite(char const *name, u8 const *data, u64 len) {
   if (!name)
     return false;
-  char cleanup(_dtor) *p = VFsFNameAbs(name);
+  char p[0x200];
+  VFsTouched();
+  detachviews(VFsFNameAbs(p, name));
   return writefile(p, data, len);
 }
 
+u8 *VFsFMap(char const *name, u64 *lenp) {
+  char p[0x200];
+  return mapview(VFsFNameAbs(p, name), lenp);
+}
+
+bool VFsFUnmap(void *p) {
+  return unmapview(p);
+}
+
 u8 *VFsFRead(char const *name, u64 *lenp) {
   if (!name)
     return NULL;
-  char cleanup(_dtor) *p = VFsFNameAbs(name);
-  if (!fexists(p) || isdir(p))
-    return NULL;
-  i64 sz;
-  if (-1 == (sz = fsize(p)))
+  char p[0x200];
+  /* open first and fstat the fd, one path walk and the size can't race */
+  int cleanup(_closefd) fd = openfd(VFsFNameAbs(p, name), false);
+  CFStat st;
+  if (fd == -1 || !statfd(fd, &st) || st.dir)
     return NULL;
   /* HolyMAlloc throws 'OutMem' on failure */
-  u8 *data = HolyMAlloc(sz + 1);
-  if (veryunlikely(!readfile(p, data, sz))) {
+  u8 *data = HolyMAlloc(st.size + 1);
+  if (veryunlikely(st.size != readfd(fd, data, st.size))) {
     HolyFree(data);
     return NULL;
   }
-  data[sz] = 0;
-  *lenp = sz;
+  data[st.size] = 0;
+  *lenp = st.size;
   return data;
 }
 
 char **VFsDir(void) {
-  char cleanup(_dtor) *path = VFsFNameAbs("");
-  if (unlikely(!isdir(path)))
+  char p[0x200];
+  if (unlikely(!VFsStat(VFsFNameAbs(p, ""))->st.dir))
     return NULL;
-  return listdir(path);
+  return listdir(p);
+}
+
+typedef struct {
+  vec_t(CVDirEntry) ents;
+  vec_char_t names;
+} CDirPack;
+
+static void dirpackcb(char const *name, CFStat const *st, void *user0) {
+  CDirPack *p = user0;
+  /* names are offsets into p->names until the block is laid out */
+  vec_push(&p->ents, ((CVDirEntry){
+                         .name = (char *)(u64)p->names.length,
+                         .size = st->size,
+                         .mtime = st->mtime,
+                         .attr = st->dir ? RS_ATTR_DIR : 0,
+                     }));
+  vec_pusharr(&p->names, name, strlen(name) + 1);
+}
+
+CVDirEntry *VFsDirStat(void) {
+  char p[0x200];
+  CDirPack pk = {0};
+  if (unlikely(!statdir(VFsFNameAbs(p, ""), dirpackcb, &pk)))
+    return NULL;
+  u64 hdr = sizeof(CVDirEntry) * (pk.ents.length + 1);
+  /* HolyMAlloc throws 'OutMem' on failure */
+  CVDirEntry *ret = HolyMAlloc(hdr + pk.names.length);
+  char *names = (char *)ret + hdr;
+  if (pk.ents.length) {
+    memcpy(ret, pk.ents.data, hdr - sizeof(CVDirEntry));
+    memcpy(names, pk.names.data, pk.names.length);
+  }
+  for (int i = 0; i < pk.ents.length; i++)
+    ret[i].name = names + (u64)ret[i].name;
+  ret[pk.ents.length] = (CVDirEntry){0};
+  vec_deinit(&pk.ents);
+  vec_deinit(&pk.names);
+  return ret;
 }
 
 bool VFsIsDir(char const *path) {
-  char cleanup(_dtor) *p = VFsFNameAbs(path);
-  return isdir(p);
+  char p[0x200];
+  return VFsStat(VFsFNameAbs(p, path))->st.dir;
 }
 
 bool VFsFExists(char const *path) {
-  char cleanup(_dtor) *absp = VFsFNameAbs(path);
-  return fexists(absp);
+  char p[0x200];
+  return VFsStat(VFsFNameAbs(p, path))->st.exists;
 }
 
 void VFsMountDrive(u8 let, char const *path) {
   if (veryunlikely(!Bt(char_bmp_alpha, let)))
     return;
   strcpy(mount_points[toupper(let) - 'A'], path);
+  VFsTouched();
 }
@@ -9,12 +9,32 @@ void VFsSetPwd(char const *pwd);
 bool VFsDirMk(char const *to);
 bool VFsDel(char const *p);
 u64 VFsFUnixTime(char const *name);
+/* -1 if it's not there, dirs get the host's size, not an entry cnt */
 i64 VFsFSize(char const *name);
 int VFsFOpen(char const *path, bool rw);
+void VFsFClose(int fd);
+/* the size of what fd has open now, -1 on error; no stat cache involved */
+i64 VFsFdSize(int fd);
 void VFsFTrunc(char const *name, u64 sz);
 bool VFsFWrite(char const *name, u8 const *data, u64 len);
 u8 *VFsFRead(char const *name, u64 *len);
+/* VFsFRead() without the copy, NULL if it can't be mapped */
+u8 *VFsFMap(char const *name, u64 *len);
+/* false if p didn't come from VFsFMap(), Free() it then */
+bool VFsFUnmap(void *p);
 bool VFsFExists(char const *path);
 bool VFsIsDir(char const *path);
 char **VFsDir(void);
+/* HolyC's CVDirEntry */
+typedef struct {
+  char *name;
+  i64 size;
+  u64 mtime;
+  u64 attr;
+} CVDirEntry;
+#define RS_ATTR_DIR 0x10
+/* VFsDir() with metadata, one HolyMAlloc'd block ending in a NULL name */
+CVDirEntry *VFsDirStat(void);
 void VFsMountDrive(u8 let, char const *path);
+/* something changed the tree under VFs, drop cached stat results */
+void VFsTouched(void);
@@ -3,12 +3,16 @@
 // Copyright 2024 1fishe2fishe
 // Refer to the LICENSE file for license info.
 // Any citation links are provided at the end of the file.
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <SDL.h>
+#include <immintrin.h>
+
+#include <vec/vec.h>
 
 #include <exodus/abi.h>
 #include <exodus/ffi.h>
@@ -20,11 +24,8 @@
 #include <exodus/window.h>
 
 static struct {
-  SDL_mutex *screen_mutex;
-  SDL_cond *screen_done_cond;
   SDL_Window *window;
-  SDL_Palette *palette;
-  SDL_Surface *surf;
+  SDL_Texture *tex;
   SDL_Renderer *rend;
   i32 sz_x, sz_y;
   i32 margin_x, margin_y;
@@ -34,14 +35,233 @@ static struct {
 enum {
   WIDTH = 640,
   HEIGHT = 480,
+  TILES_X = WIDTH / TILE_W,
+  TILES_Y = HEIGHT / TILE_H,
+};
+
+/* ARGB8888, set by GrPaletteColorSet from HolyC and read by the event
+ * thread, paldirty tells updatescrn to reconvert the whole frame */
+static u32 palette[256];
+static bool paldirty;
+
+/* Latest-frame-wins mailbox between the producer (DrawWindowUpdateTiles)
+ * and the event thread. Three frames so neither side ever waits on the
+ * other: the producer fills back, the event thread presents front and the
+ * third sits in mailbox. Swapping back into mailbox with MAILBOX_NEW set
+ * publishes a frame, if the old one still had MAILBOX_NEW set it was never
+ * presented and counts as dropped. Each frame carries the tiles that
+ * changed since the last frame the event thread picked up */
+enum {
+  MAILBOX_NEW = 4,
+};
+static struct {
+  u8 px[3][WIDTH * HEIGHT];
+  u64 dirty[3][DIRTY_WORDS];
+  u32 mailbox;
+  /* is there a WINDOW_UPDATE event in the queue? */
+  bool queued;
+  u64 presented, dropped;
+  /* producer only */
+  u64 carry[DIRTY_WORDS];
+  u32 back;
+  /* event thread only */
+  u32 front;
+} frm = {
+    .back = 0,
+    .mailbox = 1,
+    .front = 2,
+};
+
+/* last frame seen by ScrnDirtyTiles, only touched by the producer
+ * (the window manager holds scrn_lock in GrUpdateScrn) */
+static u8 prevfrm[WIDTH * HEIGHT];
+static bool prevvalid;
+
+/* --headless: no SDL video at all, frames are converted into fb
+ * instead of a texture and optionally dumped every nth frame */
+static struct {
+  char const *dir;
+  u64 every;
+  bool on, png;
+  u32 *fb;
+} headless;
+
+/* Frame times measured on the producer side, render is from ScrnFrameBegin
+ * to DrawWindowUpdateTiles (what GR/ and DolDoc cost), interval is between
+ * two DrawWindowUpdateTiles calls. Summarized every STATS_WIN frames */
+enum {
+  STATS_WIN = 256,
 };
+static struct {
+  i64 begin, last;
+  i64 render[STATS_WIN];
+  i64 interval;
+  u64 n, frames;
+} stats;
+
+static void convscalar(u32 *restrict dst, u8 const *restrict src, u64 n) {
+  for (u64 i = 0; i < n; ++i)
+    dst[i] = palette[src[i]];
+}
+
+/* SSE2 has no gather so the baseline is the table lookup above,
+ * AVX2 widens 8 indices at a time and gathers straight from palette */
+__attribute__((target("avx2"))) static void convavx2(u32 *restrict dst,
+                                                     u8 const *restrict src,
+                                                     u64 n) {
+  u64 i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i idx =
+        _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *)(src + i)));
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm256_i32gather_epi32((int const *)palette, idx, 4));
+  }
+  convscalar(dst + i, src + i, n - i);
+}
+
+static void (*conv)(u32 *restrict, u8 const *restrict, u64) = convscalar;
+
+static void convrect(u8 const *px, u64 x, u64 y, u64 w, u64 h) {
+  u8 *dst;
+  int pitch;
+  if (headless.on) {
+    dst = (u8 *)(headless.fb + y * WIDTH + x);
+    pitch = WIDTH * sizeof *headless.fb;
+  } else
+    SDL_LockTexture(win.tex, &(SDL_Rect){x, y, w, h}, (void **)&dst, &pitch);
+  for (u64 i = 0; i < h; ++i)
+    conv((u32 *)(dst + i * pitch), px + (y + i) * WIDTH + x, w);
+  if (!headless.on)
+    SDL_UnlockTexture(win.tex);
+}
+
+static u32 crctab[256];
+
+static u32 crc32(u32 crc, u8 const *p, u64 n) {
+  if (veryunlikely(!crctab[1]))
+    for (u32 i = 0, c; i < 256; crctab[i++] = c)
+      for (int k = (c = i, 0); k < 8; ++k)
+        c = c & 1 ? 0xedb88320u ^ c >> 1 : c >> 1;
+  crc = ~crc;
+  while (n--)
+    crc = crctab[(crc ^ *p++) & 0xff] ^ crc >> 8;
+  return ~crc;
+}
+
+static void put32be(vec_char_t *v, u32 x) {
+  char b[] = {x >> 24, x >> 16, x >> 8, x};
+  vec_pusharr(v, b, 4);
+}
+
+static void pngchunk(vec_char_t *v, char const type[static 4], void const *data,
+                     u32 len) {
+  put32be(v, len);
+  vec_pusharr(v, type, 4);
+  vec_pusharr(v, (char const *)data, len);
+  put32be(v, crc32(crc32(0, (u8 const *)type, 4), data, len));
+}
+
+/* 8-bit indexed PNG[1] with the current palette. The zlib stream is made of
+ * stored (uncompressed) deflate blocks[2] so there's no zlib dependency,
+ * frames are for diffing in CI, not for keeping */
+static void writepng(char const *path, u8 const *px) {
+  vec_char_t png, z;
+  vec_init(&png);
+  vec_init(&z);
+  vec_pusharr(&png, "\x89PNG\r\n\x1a\n", 8);
+  put32be(&z, WIDTH);
+  put32be(&z, HEIGHT);
+  /* depth 8, color type 3 (indexed), deflate, no filter, no interlace */
+  vec_pusharr(&z, ((char[]){8, 3, 0, 0, 0}), 5);
+  pngchunk(&png, "IHDR", z.data, z.length);
+  vec_clear(&z);
+  for (u64 i = 0; i < 256; ++i)
+    vec_pusharr(&z, ((char[]){palette[i] >> 16, palette[i] >> 8, palette[i]}),
+                3);
+  pngchunk(&png, "PLTE", z.data, z.length);
+  vec_clear(&z);
+  /* every scanline is prefixed with its filter type (0, none) */
+  u64 rowsz = WIDTH + 1, rawsz = rowsz * HEIGHT, blk;
+  u8 *raw = malloc(rawsz);
+  for (u64 y = 0; y < HEIGHT; ++y) {
+    raw[y * rowsz] = 0;
+    memcpy(raw + y * rowsz + 1, px + y * WIDTH, WIDTH);
+  }
+  u32 a = 1, b = 0; // adler32
+  for (u64 i = 0; i < rawsz; ++i) {
+    a = (a + raw[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  vec_pusharr(&z, "\x78\x01", 2);
+  for (u64 off = 0; off < rawsz; off += blk) {
+    blk = Min(rawsz - off, 0xffffu);
+    /* BFINAL, BTYPE=00, LEN, NLEN (little endian) */
+    vec_pusharr(&z,
+                ((char[]){off + blk == rawsz, blk, blk >> 8, ~blk, ~blk >> 8}),
+                5);
+    vec_pusharr(&z, (char *)raw + off, blk);
+  }
+  put32be(&z, b << 16 | a);
+  pngchunk(&png, "IDAT", z.data, z.length);
+  pngchunk(&png, "IEND", NULL, 0);
+  if (!writefile(path, (u8 *)png.data, png.length))
+    flushprint(stderr, "Failed to write frame to \"%s\"\n", path);
+  free(raw);
+  vec_deinit(&png);
+  vec_deinit(&z);
+}
+
+static void dumpframe(u8 const *px) {
+  u64 n = ScrnFramesPresented();
+  if (!headless.dir || n % headless.every)
+    return;
+  char path[0x200];
+  snprintf(path, sizeof path, "%s/%08" PRIu64 ".%s", headless.dir, n,
+           headless.png ? "png" : "raw");
+  if (headless.png)
+    writepng(path, px);
+  /* ARGB8888 little endian, ffmpeg -f rawvideo -pix_fmt bgra -s 640x480 */
+  else if (!writefile(path, (u8 *)headless.fb,
+                      WIDTH * HEIGHT * sizeof *headless.fb))
+    flushprint(stderr, "Failed to write frame to \"%s\"\n", path);
+}
 
-static void updatescrn(u8 *px) {
-  SDL_LockSurface(win.surf);
-  u8 *dst = win.surf->pixels, *src = px;
-  u64 sz = WIDTH * HEIGHT;
-  asm("rep movsb" : "+D"(dst), "+S"(src), "+c"(sz), "=m"(*(char(*)[sz])dst));
-  SDL_UnlockSurface(win.surf);
+static void updatescrn(void) {
+  u64 *dirty, t, x0;
+  u8 *px;
+  LBtr(&frm.queued, 0);
+  /* nothing new, the event was coalesced into a previous one */
+  if (!(__atomic_load_n(&frm.mailbox, __ATOMIC_ACQUIRE) & MAILBOX_NEW))
+    return;
+  frm.front = __atomic_exchange_n(&frm.mailbox, frm.front, __ATOMIC_ACQ_REL) &
+              ~MAILBOX_NEW;
+  px = frm.px[frm.front];
+  dirty = frm.dirty[frm.front];
+  __atomic_fetch_add(&frm.presented, 1, __ATOMIC_RELAXED);
+  if (LBtr(&paldirty, 0)) {
+    convrect(px, 0, 0, WIDTH, HEIGHT);
+    goto present;
+  }
+  /* only convert and upload what changed, merging horizontal runs of
+   * dirty tiles into one rect so a scrolling console is one lock per
+   * tile row instead of one per tile */
+  for (u64 ty = 0; ty < TILES_Y; ++ty) {
+    for (u64 tx = 0; tx < TILES_X;) {
+      t = ty * TILES_X + tx;
+      if (!Bt(dirty, t)) {
+        ++tx;
+        continue;
+      }
+      for (x0 = tx; tx < TILES_X && Bt(dirty, t); ++tx, ++t)
+        ;
+      convrect(px, x0 * TILE_W, ty * TILE_H, (tx - x0) * TILE_W, TILE_H);
+    }
+  }
+present:
+  if (headless.on) {
+    dumpframe(px);
+    return;
+  }
   SDL_RenderClear(win.rend);
   int w, h, w2, h2, margin_x = 0, margin_y = 0;
   SDL_GetWindowSize(win.window, &w, &h);
@@ -61,14 +281,19 @@ static void updatescrn(u8 *px) {
       .w = win.sz_x = w2,
       .h = win.sz_y = h2,
   };
-  SDL_Texture *t = SDL_CreateTextureFromSurface(win.rend, win.surf);
-  SDL_RenderCopy(win.rend, t, NULL, &viewport);
+  SDL_RenderCopy(win.rend, win.tex, NULL, &viewport);
   SDL_RenderPresent(win.rend);
-  SDL_DestroyTexture(t);
-  SDL_CondBroadcast(win.screen_done_cond);
 }
 
 static void newwindow(void) {
+  if (__builtin_cpu_supports("avx2"))
+    conv = convavx2;
+  LBts(&paldirty, 0);
+  if (headless.on) {
+    headless.fb = calloc(WIDTH * HEIGHT, sizeof *headless.fb);
+    LBts(&win.ready, 0);
+    return;
+  }
   if (SDL_Init(SDL_INIT_VIDEO) < 0) {
     flushprint(stderr,
                "Failed to init SDL_video: "
@@ -80,25 +305,21 @@ static void newwindow(void) {
                           SDL_HINT_OVERRIDE);
   SDL_SetHintWithPriority(SDL_HINT_RENDER_SCALE_QUALITY, "linear",
                           SDL_HINT_OVERRIDE);
-  win.screen_mutex = SDL_CreateMutex();
-  win.screen_done_cond = SDL_CreateCond();
-  SDL_LockMutex(win.screen_mutex);
   win.window =
       SDL_CreateWindow("EXODUS", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
                        640, 480, SDL_WINDOW_RESIZABLE);
-  win.surf = SDL_CreateRGBSurface(0, 640, 480, 8, 0, 0, 0, 0);
-  win.palette = SDL_AllocPalette(256);
-  SDL_SetSurfacePalette(win.surf, win.palette);
   SDL_SetWindowMinimumSize(win.window, 640, 480);
   // SDL_RENDERER_ACCELERATED will not fall back to software
   win.rend = SDL_CreateRenderer(win.window, -1, 0);
+  /* persistent texture, updatescrn converts the palette itself */
+  win.tex = SDL_CreateTexture(win.rend, SDL_PIXELFORMAT_ARGB8888,
+                              SDL_TEXTUREACCESS_STREAMING, WIDTH, HEIGHT);
   win.margin_y = win.margin_x = 0;
   win.sz_x = 640;
   win.sz_y = 480;
   /* let TempleOS manage the cursor */
   SDL_ShowCursor(SDL_DISABLE);
   SDL_SetWindowKeyboardGrab(win.window, SdlGrab());
-  SDL_UnlockMutex(win.screen_mutex);
   LBts(&win.ready, 0);
 }
 
@@ -558,7 +779,7 @@ void EventLoop(void) {
     case SDL_USEREVENT:
       switch (e.user.code) {
       case WINDOW_UPDATE:
-        updatescrn(e.user.data1);
+        updatescrn();
         break;
       case WINDOW_NEW:
         newwindow();
@@ -587,19 +808,134 @@ char *ClipboardText(argign void *args) {
   return HolyStrDup(s);
 }
 
-void DrawWindowUpdate(u8 *px) {
+/* Marks the TILE_W*TILE_H tiles of px that differ from the previous frame
+ * in dirty and returns how many there are. Each tile row is compared 16
+ * bytes at a time and bails on the first difference, and only dirty tiles
+ * are copied into prevfrm, so a static desktop costs one read-only pass.
+ * That's just the check, the frame itself is still copied whole into the
+ * mailbox by DrawWindowUpdateTiles (a palette change converts all of it)
+ * and its dirty tiles converted into the SDL texture by updatescrn */
+u64 ScrnDirtyTiles(u8 const *px, u64 *dirty) {
+  __m128i x;
+  u8 const *a, *b;
+  u64 t, n = 0;
+  bool d;
+  memset(dirty, 0, DIRTY_WORDS * sizeof *dirty);
+  for (u64 ty = 0; ty < TILES_Y; ++ty) {
+    for (u64 tx = 0; tx < TILES_X; ++tx) {
+      t = ty * TILES_X + tx;
+      d = !prevvalid;
+      for (u64 y = ty * TILE_H; !d && y < (ty + 1) * TILE_H; ++y) {
+        a = px + y * WIDTH + tx * TILE_W;
+        b = prevfrm + y * WIDTH + tx * TILE_W;
+        x = _mm_setzero_si128();
+        for (u64 i = 0; i < TILE_W; i += 16)
+          x = _mm_or_si128(x, _mm_xor_si128(_mm_loadu_si128((void *)(a + i)),
+                                            _mm_loadu_si128((void *)(b + i))));
+        d = 0xffff != _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128()));
+      }
+      if (!d)
+        continue;
+      dirty[t / 64] |= 1ull << t % 64;
+      ++n;
+      for (u64 y = ty * TILE_H; y < (ty + 1) * TILE_H; ++y)
+        memcpy(prevfrm + y * WIDTH + tx * TILE_W, px + y * WIDTH + tx * TILE_W,
+               TILE_W);
+    }
+  }
+  prevvalid = true;
+  return n;
+}
+
+static int i64cmp(void const *_a, void const *_b) {
+  i64 a = *(i64 const *)_a, b = *(i64 const *)_b;
+  return (a > b) - (a < b);
+}
+
+void ScrnFrameBegin(void) {
+  stats.begin = getticksus();
+}
+
+static void framestats(void) {
+  i64 now = getticksus();
+  if (stats.begin)
+    stats.render[stats.n++] = now - stats.begin;
+  if (stats.last)
+    stats.interval += now - stats.last;
+  stats.last = now;
+  stats.begin = 0;
+  stats.frames++;
+  if (stats.n < STATS_WIN)
+    return;
+  i64 *r = stats.render, sum = 0;
+  qsort(r, STATS_WIN, sizeof *r, i64cmp);
+  for (u64 i = 0; i < STATS_WIN; ++i)
+    sum += r[i];
+  flushprint(stderr,
+             "frames %" PRIu64 ": render min/avg/p50/p99/max "
+             "%.2f/%.2f/%.2f/%.2f/%.2fms, interval avg %.2fms, "
+             "presented %" PRIu64 ", dropped %" PRIu64 "\n",
+             stats.frames, r[0] / 1e3, sum / 1e3 / STATS_WIN,
+             r[STATS_WIN / 2] / 1e3, r[STATS_WIN * 99 / 100] / 1e3,
+             r[STATS_WIN - 1] / 1e3, stats.interval / 1e3 / STATS_WIN,
+             ScrnFramesPresented(), ScrnFramesDropped());
+  stats.n = 0;
+  stats.interval = 0;
+}
+
+void DrawWindowUpdateTiles(u8 *px, u64 const *dirty) {
+  u32 old;
+  if (headless.on)
+    framestats();
+  memcpy(frm.px[frm.back], px, WIDTH * HEIGHT);
+  for (u64 i = 0; i < DIRTY_WORDS; ++i)
+    frm.dirty[frm.back][i] = dirty[i] | frm.carry[i];
+  old = __atomic_exchange_n(&frm.mailbox, frm.back | MAILBOX_NEW,
+                            __ATOMIC_ACQ_REL);
+  frm.back = old & ~MAILBOX_NEW;
+  /* the event thread never saw the frame we just got back,
+   * its tiles have to go out with the next one */
+  if (old & MAILBOX_NEW) {
+    __atomic_fetch_add(&frm.dropped, 1, __ATOMIC_RELAXED);
+    memcpy(frm.carry, frm.dirty[frm.back], sizeof frm.carry);
+  } else
+    memset(frm.carry, 0, sizeof frm.carry);
+  if (LBts(&frm.queued, 0))
+    return;
   /* SDL is not fond of threads other than the thread that initialized SDL, so
    * we push to the event queue and let SDL do the rest */
   SDL_PushEvent(&(SDL_Event){
       .user = {
                .type = SDL_USEREVENT,
                .code = WINDOW_UPDATE,
-               .data1 = px,
                }
   });
-  SDL_LockMutex(win.screen_mutex);
-  SDL_CondWaitTimeout(win.screen_done_cond, win.screen_mutex, 1e3 / GetFPS());
-  // CondWaitTimeout unlocks the mutex for us
+}
+
+u64 ScrnFramesPresented(void) {
+  return __atomic_load_n(&frm.presented, __ATOMIC_RELAXED);
+}
+
+u64 ScrnFramesDropped(void) {
+  return __atomic_load_n(&frm.dropped, __ATOMIC_RELAXED);
+}
+
+void SetHeadless(char const *dumpdir, u64 every, bool png) {
+  headless = (typeof(headless)){
+      .on = true,
+      .dir = dumpdir,
+      .every = every ?: 1,
+      .png = png,
+  };
+  /* CI boxes usually have no sound card either, don't let
+   * InitSound() bail out (unless the user picked a driver) */
+  SDL_setenv("SDL_AUDIODRIVER", "dummy", 0);
+}
+
+void DrawWindowUpdate(u8 *px) {
+  u64 dirty[DIRTY_WORDS];
+  ScrnDirtyTiles(px, dirty);
+  DrawWindowUpdateTiles(px, dirty);
 }
 
 void DrawWindowNew(void) {
@@ -647,13 +983,16 @@ void GrPaletteColorSet(u64 i, u64 _u) {
   } u = {.i = _u};
   /* 0xffff is 100% so 0x7fff/0xffff would be about .50
    * this gets multiplied by 0xff to get 0x7f */
-  SDL_Color c = {
-      .r = u.r / (double)0xffff * 0xff,
-      .g = u.g / (double)0xffff * 0xff,
-      .b = u.b / (double)0xffff * 0xff,
-      .a = 0xff,
-  };
+  u32 c = 0xffu << 24 | (u32)(u.r / (double)0xffff * 0xff) << 16 |
+          (u32)(u.g / (double)0xffff * 0xff) << 8 |
+          (u32)(u.b / (double)0xffff * 0xff);
   // set column
   for (int col = 0; col < 256 / 16; ++col)
-    SDL_SetPaletteColors(win.palette, &c, i + col * 16, 1);
+    palette[i + col * 16] = c;
+  LBts(&paldirty, 0);
 }
+
+/* CITATIONS:
+ * [1] https://www.w3.org/TR/png/#11IHDR
+ * [2] https://www.rfc-editor.org/rfc/rfc1951#section-3.2.4
+ */
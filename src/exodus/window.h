@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+
 #include <exodus/misc.h>
 #include <exodus/types.h>
 
@@ -7,6 +9,18 @@ void SetClipboard(char const *text);
 char *ClipboardText(argign void *stk);
 void DrawWindowNew(void);
 void DrawWindowUpdate(u8 *px);
+
+/* dirty tracking for the 640x480 frame, one bit per tile, row major */
+#define TILE_W      64
+#define TILE_H      16
+#define DIRTY_WORDS ((640 / TILE_W * (480 / TILE_H) + 63) / 64)
+u64 ScrnDirtyTiles(u8 const *px, u64 *dirty);
+void DrawWindowUpdateTiles(u8 *px, u64 const *dirty);
+u64 ScrnFramesPresented(void);
+u64 ScrnFramesDropped(void);
+void ScrnFrameBegin(void);
+/* call before DrawWindowNew, dumpdir may be NULL */
+void SetHeadless(char const *dumpdir, u64 every, bool png);
 void EventLoop(void);
 void PCSpkInit(void);
 void GrPaletteColorSet(u64 i, u64 _u);
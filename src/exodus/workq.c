@@ -0,0 +1,116 @@
+// vi: set et ft=c ts=2 sts=2 sw=2 fenc=utf-8 :vi
+//
+// Copyright 2024 1fishe2fishe
+// Refer to the LICENSE file for license info.
+// Any citation links are provided at the end of the file.
+#include <stdlib.h>
+
+#include <exodus/misc.h>
+#include <exodus/seth.h>
+#include <exodus/shims.h>
+#include <exodus/types.h>
+#include <exodus/workq.h>
+
+/* Work-stealing deques
+ *
+ * JobQue() hands work to a core the caller picks, through a CJobCtrl queue
+ * behind a spin bit. ParallelFor() (JOB.HC) instead pushes its chunks onto
+ * the deque of the core it runs on and lets everyone else steal them: the
+ * owner pushes and pops at the bottom (LIFO, cache-warm), idle Seth cores
+ * take from the top. Chase-Lev[1] with the C11 orderings from [2].
+ *
+ * The owner of a deque is whatever HolyC task is running on that core.
+ * Tasks only switch in Yield(), never in the middle of one of these calls,
+ * so there's only ever one owner at a time.
+ *
+ * Deques don't grow, ParallelFor() runs whatever doesn't fit inline.
+ */
+#define WORKQ_SZ 0x1000u
+
+typedef struct {
+  _Atomic(i64) top;
+  u8 pad[64 - sizeof(i64)]; /* thieves and the owner on separate lines */
+  _Atomic(i64) bottom;
+  void *_Atomic buf[WORKQ_SZ];
+} CWorkQ;
+
+/* allocated by the owner on first push */
+static CWorkQ *_Atomic workqs[MP_PROCESSORS_NUM];
+
+bool WorkPush(void *job) {
+  u64 core = CoreNum();
+  CWorkQ *q = workqs[core];
+  if (veryunlikely(!q)) {
+    if (!(q = calloc(1, sizeof *q)))
+      return false;
+    __atomic_store_n(&workqs[core], q, __ATOMIC_RELEASE);
+  }
+  i64 b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED),
+      t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+  if (b - t >= WORKQ_SZ)
+    return false;
+  __atomic_store_n(&q->buf[b & (WORKQ_SZ - 1)], job, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+  WakeIdleCore();
+  return true;
+}
+
+void *WorkPop(void) {
+  CWorkQ *q = workqs[CoreNum()];
+  if (!q)
+    return NULL;
+  i64 b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  i64 t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+  void *job = NULL;
+  if (t <= b) {
+    job = __atomic_load_n(&q->buf[b & (WORKQ_SZ - 1)], __ATOMIC_RELAXED);
+    if (t != b)
+      return job;
+    /* last one, race the thieves for it */
+    if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      job = NULL;
+  }
+  __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+  return job;
+}
+
+static void *steal(CWorkQ *q) {
+  i64 t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  i64 b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+  if (t >= b)
+    return NULL;
+  void *job = __atomic_load_n(&q->buf[t & (WORKQ_SZ - 1)], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, false, __ATOMIC_SEQ_CST,
+                                   __ATOMIC_RELAXED))
+    return NULL;
+  return job;
+}
+
+void *WorkSteal(void) {
+  /* keep robbing whoever had work last time */
+  static _Thread_local u64 start;
+  u64 n = mp_cnt(), self = CoreNum();
+  for (u64 i = 0; i < n; i++) {
+    u64 victim = (start + i) % n;
+    CWorkQ *q = __atomic_load_n(&workqs[victim], __ATOMIC_ACQUIRE);
+    void *job;
+    if (victim != self && q && (job = steal(q))) {
+      start = victim;
+      return job;
+    }
+  }
+  return NULL;
+}
+
+/* CITATIONS:
+ * [1] Chase, Lev: Dynamic Circular Work-Stealing Deque (SPAA 2005)
+ *     https://doi.org/10.1145/1073970.1073974
+ * [2] Lê, Pop, Cohen, Zappa Nardelli: Correct and Efficient Work-Stealing for
+ *     Weak Memory Models (PPoPP 2013)
+ *     https://doi.org/10.1145/2442516.2442524
+ */
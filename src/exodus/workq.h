@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdbool.h>
+
+/* Per-core work-stealing deques for ParallelFor(), q.v. workq.c */
+
+/* false when this core's deque is full, run it inline then */
+bool WorkPush(void *job);
+/* newest job pushed on this core or NULL */
+void *WorkPop(void);
+/* oldest job of some other core or NULL */
+void *WorkSteal(void);